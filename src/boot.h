@@ -0,0 +1,34 @@
+/*
+ * Boot phases timestamps, in us since timer start (bootrom and clock setup, a few ms after power-on, are not included).
+ *
+ * Startup is staged so that a note can be sent as early as possible on a cold plug-in: USB device stack and switches
+ * come up first, then the main loop starts; stdio, neopixel and event log init are deferred until device is mounted.
+ * Timestamps are returned by SysEx (see sysex.h).
+ */
+
+#ifndef _BOOT_H_
+#define _BOOT_H_
+
+#include <stdint.h>
+#include "pico/stdlib.h"
+
+// boot phases
+enum {
+	BOOT_BOARD,			// board_init() done
+	BOOT_USB,			// USB device stack initialized
+	BOOT_SWITCHES,		// switches and preset banks ready: a press can be recorded from now on
+	BOOT_LOOP,			// first run of main loop
+	BOOT_MOUNT,			// device mounted by host: first possible note
+	BOOT_LAZY,			// deferred init done (stdio, neopixel, event log)
+	BOOT_PHASES
+};
+
+extern uint32_t boot_time [BOOT_PHASES];
+
+// record time of a boot phase, first occurrence only
+static inline void boot_mark (int phase)
+{
+	if (boot_time [phase] == 0) boot_time [phase] = time_us_32 ();
+}
+
+#endif /* _BOOT_H_ */
@@ -0,0 +1,40 @@
+/*
+ * Run-time configuration of the pedal, see config.h
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+
+#include "config.h"
+
+
+// compile-time defaults, used for preset banks never stored in flash
+const struct pedal_config config_default = {
+	.magic = CONFIG_MAGIC,
+	.note = { NOTE_SW1, NOTE_SW2, NOTE_SW3, NOTE_SW4, NOTE_SW5, NOTE_SW6, NOTE_SW7, NOTE_SW8 },
+	.channel = CHANNEL,
+	.color = { COLOR_RED, COLOR_YELLOW },
+	.hold_us = HOLD_US,
+	.repeat = { REPEAT_DEFAULT, REPEAT_DEFAULT, REPEAT_DEFAULT, REPEAT_DEFAULT,
+				REPEAT_DEFAULT, REPEAT_DEFAULT, REPEAT_DEFAULT, REPEAT_DEFAULT },
+};
+
+// configuration being edited
+struct pedal_config config;
+
+
+// check whether a configuration image (eg. stored in flash) is valid
+bool config_valid (const struct pedal_config *cfg)
+{
+	int i;
+
+	if (cfg->magic != CONFIG_MAGIC) return false;
+
+	// sanity check on values, as image may come from a dump
+	if (cfg->channel > 15) return false;
+	for (i = 0; i < NUM_SWITCHES; i++) {
+		if (cfg->note [i] > 127) return false;
+		if ((cfg->repeat [i].mode > REPEAT_ARP) || (cfg->repeat [i].steps < 1) || (cfg->repeat [i].steps > REPEAT_MAX_STEPS)) return false;
+	}
+	return true;
+}
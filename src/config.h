@@ -0,0 +1,86 @@
+/*
+ * Run-time configuration of the pedal: switch-to-note map, midi channel, neopixel colors and hold time.
+ * These used to be compile-time #defines in main.c; they are now held in RAM so they can be changed
+ * over SysEx (see sysex.h), and saved as preset banks in a reserved region at the end of flash (see preset.h).
+ */
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+#define NUM_SWITCHES	8	// 5 pedal switches + 3 finger switches
+#define NUM_COLORS		2	// 0: color for note-on with velocity 127, 1: color for other velocities
+
+// default midi channel
+#define CHANNEL		0     // midi channel 1
+
+// default midi notes corresponding to foot pedal switches
+#define NOTE_SW1	0
+#define NOTE_SW2	1
+#define NOTE_SW3	2
+#define NOTE_SW4	3
+#define NOTE_SW5	4
+// default midi notes corresponding to finger switches
+#define NOTE_SW6	5
+#define NOTE_SW7	6
+#define NOTE_SW8	7
+
+// default neopixel colors (GRB order, as returned by rgb_to_color()) and hold time
+#define COLOR_RED		0x00FF00
+#define COLOR_YELLOW	0xFFFF00
+#define HOLD_US			150000	// neopixel is painted black 150ms after being lit
+
+// default note repeat / arpeggiator settings (see repeat.h); repeat is off on all switches
+#define REPEAT_PERIOD_US	125000	// 16th notes at 120 bpm
+#define REPEAT_CLOCK_DIV	6		// 16th notes when following MIDI clock (24 ticks per quarter note)
+#define REPEAT_GATE			50		// note-on duration, in % of period
+#define REPEAT_DEFAULT		{ .mode = REPEAT_OFF, .clock_div = 0, .gate = REPEAT_GATE, .steps = 1, .interval = { 0, 0, 0, 0 }, .period_us = REPEAT_PERIOD_US }
+
+
+// flash region reserved for configuration, at the very end of flash
+// this is where SysEx dumps are written (see sysex.c); preset banks are stored one per sector (see preset.h)
+#define CONFIG_FLASH_SIZE	(64 * 1024)
+#define CONFIG_FLASH_OFFSET	(PICO_FLASH_SIZE_BYTES - CONFIG_FLASH_SIZE)		// offset from start of flash, as used by flash_range_xxx()
+#define CONFIG_MAGIC		0x50444C32		// "PDL2"; "PDL1" images (without repeat settings) are ignored
+
+// note repeat modes
+enum {
+	REPEAT_OFF,						// note-on on press only
+	REPEAT_ON,						// note is retriggered while switch is held
+	REPEAT_ARP,						// same, note is offset by interval[] on each step
+};
+
+#define REPEAT_MAX_STEPS	4
+
+// type definition
+struct repeat_config {
+	uint8_t mode;					// REPEAT_OFF, REPEAT_ON or REPEAT_ARP
+	uint8_t clock_div;				// if not 0, steps follow incoming MIDI clock: one step every clock_div ticks
+	uint8_t gate;					// note-on duration, in % of period
+	uint8_t steps;					// number of arpeggiator steps, 1 to REPEAT_MAX_STEPS
+	int8_t interval [REPEAT_MAX_STEPS];	// arpeggiator: note offset of each step, in semitones
+	uint32_t period_us;				// time between 2 note-ons, when not following MIDI clock
+};
+
+struct pedal_config {
+	uint32_t magic;					// CONFIG_MAGIC when image is valid
+	uint8_t note[NUM_SWITCHES];		// midi note sent for each switch (index 0 is SWITCH_1)
+	uint8_t channel;				// midi channel, 0 to 15
+	uint8_t reserved[3];
+	uint32_t color[NUM_COLORS];		// neopixel colors
+	uint32_t hold_us;				// time neopixel stays lit, in us
+	struct repeat_config repeat [NUM_SWITCHES];	// note repeat settings of each switch
+};
+
+// configuration being edited; it is copied into the active preset table by preset_apply()
+extern struct pedal_config config;
+extern const struct pedal_config config_default;
+
+// function prototypes
+bool config_valid (const struct pedal_config *);
+
+#endif /* _CONFIG_H_ */
@@ -0,0 +1,196 @@
+/*
+ * DIN MIDI output, see din_midi.h
+ */
+
+#include "pico/stdlib.h"
+#include "hardware/uart.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+
+#include "midi.h"
+#include "flash_writer.h"
+#include "din_midi.h"
+
+
+// type definition
+struct din_msg {
+	uint64_t time;					// time message was queued
+	uint32_t end;					// ring position after last byte of message
+};
+
+bool din_thru = DIN_THRU;
+struct din_stats din_stats;
+
+static const uint8_t cin_length [16] = MIDI_CIN_LENGTHS;
+
+// TX ring; positions are free-running, and wrapped on access
+// head is written by din_send(), tail by DMA interrupt
+static uint8_t ring [DIN_RING_SIZE];
+static volatile uint32_t head = 0;
+static volatile uint32_t tail = 0;
+static volatile uint32_t dma_len = 0;		// number of bytes being sent by DMA, 0 if DMA is idle
+static int dma_chan;
+
+// messages being sent, for latency measurement; there cannot be more messages than bytes in ring
+static struct din_msg msgs [DIN_RING_SIZE];
+static volatile uint32_t msg_head = 0;
+static volatile uint32_t msg_tail = 0;
+
+static uint8_t running = 0;				// running status, 0 if none
+static uint32_t reserved = 0;			// bytes of ring reserved for note-offs, see din_reserve()
+
+
+// send bytes from tail, up to head or end of ring; remaining bytes are sent by next transfer
+// called with DMA idle, from DMA interrupt or with interrupts disabled
+static void dma_start (void)
+{
+	uint32_t idx = tail & (DIN_RING_SIZE - 1);
+	uint32_t len = head - tail;
+
+	if (len == 0) return;
+	if (idx + len > DIN_RING_SIZE) len = DIN_RING_SIZE - idx;
+
+	dma_len = len;
+	dma_channel_transfer_from_buffer_now (dma_chan, &ring [idx], len);
+}
+
+// transfer complete: last byte has been handed to UART (FIFO is disabled, so its transmission starts at once)
+static void dma_irq (void)
+{
+	struct din_msg *msg;
+	uint32_t latency;
+	uint64_t now;
+
+	if (!dma_channel_get_irq0_status (dma_chan)) return;		// shared interrupt
+	dma_channel_acknowledge_irq0 (dma_chan);
+
+	tail += dma_len;
+	dma_len = 0;
+
+	// latency of messages fully sent
+	now = time_us_64 ();
+	while (msg_tail != msg_head) {
+		msg = &msgs [msg_tail % DIN_RING_SIZE];
+		if ((int32_t) (tail - msg->end) < 0) break;
+		latency = (uint32_t) (now - msg->time);
+		if (flash_writer_time > msg->time) {
+			// a flash operation was done meanwhile, with interrupts disabled: next transfer may have been held back
+			if (latency > din_stats.flash_max_latency_us) din_stats.flash_max_latency_us = latency;
+			din_stats.flash_delayed++;
+		}
+		else {
+			if (latency > din_stats.max_latency_us) din_stats.max_latency_us = latency;
+			din_stats.sum_latency_us += latency;
+		}
+		din_stats.messages++;
+		msg_tail++;
+	}
+
+	dma_start ();
+}
+
+void din_init (void)
+{
+	dma_channel_config c;
+
+	uart_init (DIN_UART, DIN_BAUDRATE);
+	uart_set_fifo_enabled (DIN_UART, false);
+	gpio_set_function (DIN_TX_PIN, GPIO_FUNC_UART);
+
+	dma_chan = dma_claim_unused_channel (true);
+	c = dma_channel_get_default_config (dma_chan);
+	channel_config_set_transfer_data_size (&c, DMA_SIZE_8);
+	channel_config_set_read_increment (&c, true);
+	channel_config_set_write_increment (&c, false);
+	channel_config_set_dreq (&c, uart_get_dreq (DIN_UART, true));
+	dma_channel_configure (dma_chan, &c, &uart_get_hw (DIN_UART)->dr, ring, 0, false);
+
+	dma_channel_set_irq0_enabled (dma_chan, true);
+	irq_add_shared_handler (DMA_IRQ_0, dma_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+	irq_set_enabled (DMA_IRQ_0, true);
+}
+
+// queue a USB-MIDI packet for DIN output; never blocks: message is dropped if ring is full
+// SysEx is not sent, as it would be interleaved with other messages
+// may be called from interrupts (see repeat.c): running status is only read and written with interrupts disabled
+// a note-off sent with use_reserved takes the room set aside by din_reserve(), so it is never dropped
+static void send (uint8_t const packet[4], bool use_reserved)
+{
+	uint8_t msg [3];
+	uint8_t cin = packet [0] & 0x0F;
+	uint8_t status = packet [1];
+	uint8_t new_running;
+	uint32_t ints;
+	uint32_t n = 0;
+	uint32_t i;
+
+	ints = save_and_disable_interrupts ();
+	new_running = running;
+	if (use_reserved && (reserved >= DIN_NOTE_OFF_SIZE)) reserved -= DIN_NOTE_OFF_SIZE;
+
+	switch (cin) {
+		case 0x2:			// system common, 2 bytes
+		case 0x3:			// system common, 3 bytes
+			new_running = 0;
+			for (i = 0; i < cin_length [cin]; i++) msg [n++] = packet [1 + i];
+			break;
+
+		case 0xF:			// single byte: realtime messages do not cancel running status
+			if (status < 0xF8) new_running = 0;
+			msg [n++] = status;
+			break;
+
+		default:
+			if ((cin < CIN_NOTEOFF) || ((status >> 4) != cin)) {			// SysEx, reserved, or malformed
+				restore_interrupts (ints);
+				return;
+			}
+			if (status != running) msg [n++] = status;
+			new_running = status;
+			for (i = 1; i < cin_length [cin]; i++) msg [n++] = packet [1 + i];
+			break;
+	}
+
+	if ((DIN_RING_SIZE - (head - tail) - reserved < n) || (msg_head - msg_tail == DIN_RING_SIZE)) {
+		din_stats.dropped++;
+		restore_interrupts (ints);
+		return;
+	}
+
+	for (i = 0; i < n; i++) ring [(head + i) & (DIN_RING_SIZE - 1)] = msg [i];
+	head += n;
+	running = new_running;
+	msgs [msg_head % DIN_RING_SIZE].time = time_us_64 ();
+	msgs [msg_head % DIN_RING_SIZE].end = head;
+	msg_head++;
+
+	if (dma_len == 0) dma_start ();
+	restore_interrupts (ints);
+}
+
+void din_send (uint8_t const packet[4])
+{
+	send (packet, false);
+}
+
+// set aside room for a note-off, so that a repeat note about to be sent can always be stopped; false if ring is too
+// full: there must be room for the note-on and its note-off, and for a repeat step (not a switch press), besides
+// DIN_PRESS_ROOM bytes kept for fresh presses
+// the note-off must then be sent with din_send_reserved()
+bool din_reserve (bool press)
+{
+	uint32_t ints;
+	bool ok;
+
+	ints = save_and_disable_interrupts ();
+	ok = (DIN_RING_SIZE - (head - tail) - reserved >= 2 * DIN_NOTE_OFF_SIZE + (press ? 0 : DIN_PRESS_ROOM));
+	if (ok) reserved += DIN_NOTE_OFF_SIZE;
+	restore_interrupts (ints);
+	return ok;
+}
+
+void din_send_reserved (uint8_t const packet[4])
+{
+	send (packet, true);
+}
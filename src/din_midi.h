@@ -0,0 +1,52 @@
+/*
+ * DIN MIDI output, at 31250 bauds on RP2040 UART, fed by DMA from a TX ring.
+ *
+ * Every message sent by midi_task() is mirrored to DIN output, whether USB is mounted or not; USB-received channel
+ * voice and realtime messages may optionally be merged in (thru). Running status is used for channel voice messages.
+ * Messages are queued whole, and a message which does not fit in the ring is dropped: DIN never stalls the USB path.
+ * Room may be reserved for the note-off of a note about to be sent (note repeat), so that note-offs are never dropped;
+ * notes of repeat steps are only sent while DIN_PRESS_ROOM bytes are left, so that repeats never starve fresh presses.
+ * Added latency per message is bounded by ring size (DIN_RING_SIZE bytes at 320us each), and measured from queuing
+ * to transmission of its last byte; latency statistics are returned by SysEx (see sysex.h).
+ * The bound does not hold across a flash operation (see flash_writer.h): interrupts are disabled, so the transfer in
+ * progress completes, but the next one is only started once the operation is over. Messages queued before a flash
+ * operation are counted apart, with their own max latency.
+ */
+
+#ifndef _DIN_MIDI_H_
+#define _DIN_MIDI_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+#define DIN_UART		uart1
+#define DIN_TX_PIN		4			// GPIO 4 (pin #6) connected to DIN socket (through 220 ohms resistor)
+#define DIN_BAUDRATE	31250
+#define DIN_RING_SIZE	64			// TX ring size, must be a power of 2; max added latency is 64 * 320us = 20.5ms,
+									// flash operations aside
+#define DIN_THRU		false		// merge USB-received messages into DIN output by default
+#define DIN_NOTE_OFF_SIZE	3		// room reserved for a note-off by din_reserve()
+#define DIN_PRESS_ROOM	(NUM_SWITCHES * 3)	// ring bytes left to fresh presses by repeat steps, see din_reserve()
+
+// type definition
+struct din_stats {
+	uint32_t messages;				// number of messages sent
+	uint32_t dropped;				// number of messages dropped because ring was full
+	uint32_t max_latency_us;		// max time from queuing to transmission of last byte
+	uint64_t sum_latency_us;		// to compute average latency
+	uint32_t flash_delayed;			// number of messages queued before a flash operation; not in latency above
+	uint32_t flash_max_latency_us;	// max latency of these messages
+};
+
+extern bool din_thru;
+extern struct din_stats din_stats;
+
+// function prototypes
+void din_init (void);
+void din_send (uint8_t const packet[4]);
+bool din_reserve (bool);
+void din_send_reserved (uint8_t const packet[4]);
+
+#endif /* _DIN_MIDI_H_ */
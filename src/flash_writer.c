@@ -0,0 +1,91 @@
+/*
+ * Flash writer, see flash_writer.h
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+#include "flash_writer.h"
+
+
+// type definition
+struct flash_write {
+	uint32_t offset;					// flash offset of page
+	bool erase;							// erase sector holding the page before writing it
+	bool program;						// write page; false for an erase alone
+	uint8_t data [FLASH_PAGE_SIZE];
+};
+
+volatile uint64_t flash_writer_time = 0;	// end of last flash operation, see din_midi.c
+
+// page queue; positions are free-running, and wrapped on access
+static struct flash_write queue [FLASH_WRITER_PAGES];
+static uint32_t head = 0;
+static uint32_t tail = 0;
+static bool erased = false;				// sector of page at tail has been erased
+
+
+// true if a page can be queued
+bool flash_writer_room (void)
+{
+	return head - tail < FLASH_WRITER_PAGES;
+}
+
+// true once all queued pages are written
+bool flash_writer_idle (void)
+{
+	return head == tail;
+}
+
+// queue a page for writing at offset (multiple of FLASH_PAGE_SIZE); return false if queue is full
+bool flash_writer_queue (uint32_t offset, uint8_t const *data, bool erase)
+{
+	struct flash_write *w = &queue [head % FLASH_WRITER_PAGES];
+
+	if (!flash_writer_room ()) return false;
+
+	w->offset = offset;
+	w->erase = erase;
+	w->program = true;
+	memcpy (w->data, data, FLASH_PAGE_SIZE);
+	head++;
+	return true;
+}
+
+// queue erase of the sector holding offset, without writing any page; return false if queue is full
+bool flash_writer_erase (uint32_t offset)
+{
+	struct flash_write *w = &queue [head % FLASH_WRITER_PAGES];
+
+	if (!flash_writer_room ()) return false;
+
+	w->offset = offset;
+	w->erase = true;
+	w->program = false;
+	head++;
+	return true;
+}
+
+// write queued pages; called from the main loop
+void flash_writer_task (void)
+{
+	struct flash_write *w = &queue [tail % FLASH_WRITER_PAGES];
+	uint32_t ints;
+
+	if (flash_writer_idle ()) return;
+
+	ints = save_and_disable_interrupts ();
+	if (w->erase && !erased) {
+		flash_range_erase (w->offset & ~(FLASH_SECTOR_SIZE - 1), FLASH_SECTOR_SIZE);
+		erased = w->program;			// page is written on next call; an erase alone is done
+	}
+	else {
+		flash_range_program (w->offset, w->data, FLASH_PAGE_SIZE);
+		erased = false;
+	}
+	flash_writer_time = time_us_64 ();
+	restore_interrupts (ints);
+	if (!erased) tail++;
+}
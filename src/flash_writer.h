@@ -0,0 +1,29 @@
+/*
+ * Flash writer: single queue of page writes, shared by preset banks, SysEx dumps and event log flush.
+ *
+ * Each queued page is copied, then written from flash_writer_task(), called from the main loop: a single flash
+ * operation (sector erase or page program) is done per call, with interrupts disabled, so USB keeps being serviced
+ * in between. Pages are written in the order they were queued, so writers never interleave inside a sector: a bank
+ * stored after a dump into the same sector is written after the whole dump.
+ * A sector may also be erased alone, ahead of the pages written into it (event log, see recorder.h).
+ */
+
+#ifndef _FLASH_WRITER_H_
+#define _FLASH_WRITER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardware/flash.h"
+
+#define FLASH_WRITER_PAGES		4			// size of page queue, must be a power of 2
+
+extern volatile uint64_t flash_writer_time;
+
+// function prototypes
+bool flash_writer_room (void);
+bool flash_writer_idle (void);
+bool flash_writer_queue (uint32_t, uint8_t const *, bool);
+bool flash_writer_erase (uint32_t);
+void flash_writer_task (void);
+
+#endif /* _FLASH_WRITER_H_ */
@@ -34,6 +34,18 @@
 #include "bsp/board_api.h"
 #include "tusb.h"
 
+#include "midi.h"
+#include "config.h"
+#include "preset.h"
+#include "recorder.h"
+#include "usb_state.h"
+#include "boot.h"
+#include "din_midi.h"
+#include "sysex.h"
+#include "flash_writer.h"
+#include "repeat.h"
+#include "usb_descriptors.h"
+
 
 /* This part is the Neopixel part. Upon receiving a MIDI note-on, we light the leds of Neopixel
  * and we keep these lit for a few ms
@@ -86,21 +98,8 @@ void light_strip (uint32_t color) {
 // MACRO CONSTANT TYPEDEF PROTYPES
 //--------------------------------------------------------------------+
 
-// MIDI constants
-#define MIDI_NOTEON	0x90
-#define CIN_NOTEON	0x9
-#define CHANNEL		0     // midi channel 1
-
-// midi notes corresponding to foot pedal switches
-#define NOTE_SW1	0
-#define NOTE_SW2	1
-#define NOTE_SW3	2
-#define NOTE_SW4	3
-#define NOTE_SW5	4
-// midi notes corresponding to finger switches
-#define NOTE_SW6	5
-#define NOTE_SW7	6
-#define NOTE_SW8	7
+// MIDI constants are in midi.h
+// midi channel, notes corresponding to switches, neopixel colors and hold time are in preset banks (config.h, preset.h)
 
 
 // pedal GPIO
@@ -113,6 +112,8 @@ void light_strip (uint32_t color) {
 #define SWITCH_6	10
 #define SWITCH_7	8
 #define SWITCH_8	9
+#define SWITCH_MASK	((1u << SWITCH_1) | (1u << SWITCH_2) | (1u << SWITCH_3) | (1u << SWITCH_4) | \
+					 (1u << SWITCH_5) | (1u << SWITCH_6) | (1u << SWITCH_7) | (1u << SWITCH_8))
 
 
 // switches stored as bit table
@@ -125,6 +126,8 @@ void light_strip (uint32_t color) {
 #define SW7			64
 #define SW8			128
 
+#define DEBOUNCE_US	50000	// switch changes are ignored for 50ms after a change
+
 
 // type definition
 struct pedalboard {
@@ -135,6 +138,7 @@ struct pedalboard {
 };
 
 // function prototypes
+void lazy_init (int);
 void midi_task(struct pedalboard *);
 int test_switch (int , struct pedalboard*);
 
@@ -143,10 +147,12 @@ int test_switch (int , struct pedalboard*);
 int main(void)
 {
 	struct pedalboard pedal;
+	int lazy_stage = 0;			// deferred init steps done
+	uint i;
 
-	stdio_init_all();
+	// stage 1: USB device stack and switches, so that a note can be sent as soon as possible
 	board_init();
-	printf("MIDI-pedal\r\n");
+	boot_mark (BOOT_BOARD);
 
 	// init device stack on configured roothub port
 	tud_init(BOARD_TUD_RHPORT);
@@ -154,73 +160,66 @@ int main(void)
 	if (board_init_after_tusb) {
 		board_init_after_tusb();
 	}
+	boot_mark (BOOT_USB);
 
-	gpio_init(SWITCH_1);
-	gpio_set_dir(SWITCH_1, GPIO_IN);
-	gpio_pull_up (SWITCH_1);		 // switch pull-up
-
-	gpio_init(SWITCH_2);
-	gpio_set_dir(SWITCH_2, GPIO_IN);
-	gpio_pull_up (SWITCH_2);		 // switch pull-up
-
-	gpio_init(SWITCH_3);
-	gpio_set_dir(SWITCH_3, GPIO_IN);
-	gpio_pull_up (SWITCH_3);		 // switch pull-up
-
-	gpio_init(SWITCH_4);
-	gpio_set_dir(SWITCH_4, GPIO_IN);
-	gpio_pull_up (SWITCH_4);		 // switch pull-up
-
-	gpio_init(SWITCH_5);
-	gpio_set_dir(SWITCH_5, GPIO_IN);
-	gpio_pull_up (SWITCH_5);		 // switch pull-up
+	// all switches are initialized at once; there is no masked call for pull-ups
+	gpio_init_mask (SWITCH_MASK);
+	gpio_set_dir_in_masked (SWITCH_MASK);
+	for (i = 0; i < 32; i++) {
+		if (SWITCH_MASK & (1u << i)) gpio_pull_up (i);		 // switch pull-up
+	}
 
-	gpio_init(SWITCH_6);
-	gpio_set_dir(SWITCH_6, GPIO_IN);
-	gpio_pull_up (SWITCH_6);		 // switch pull-up
+	// load preset banks stored in flash, if any, and make bank 0 active
+	preset_init ();
 
-	gpio_init(SWITCH_7);
-	gpio_set_dir(SWITCH_7, GPIO_IN);
-	gpio_pull_up (SWITCH_7);		 // switch pull-up
+	// DIN output does not depend on USB, so it is ready as early as switches
+	din_init ();
 
-	gpio_init(SWITCH_8);
-	gpio_set_dir(SWITCH_8, GPIO_IN);
-	gpio_pull_up (SWITCH_8);		 // switch pull-up
+	// note repeat runs from a hardware alarm, independently of the main loop
+	repeat_init ();
 
 	// init pedal structure to all 0
 	pedal.value = 0;
 	pedal.change_state = false;
 	pedal.change_value = 0;
 	pedal.change_time = 0;
+	boot_mark (BOOT_SWITCHES);
 
-	// Neopixels inits
-	// Initialize PIO and load the WS2812 program
-	uint offset = (uint) pio_add_program (pio, &ws2812_program);
-	ws2812_program_init (pio, sm, offset, LED_PIN, 800000, false);
-	// End of NeoPixel inits
-
+	// stage 2 (stdio, neopixel, event log) is done from the main loop, once device is mounted
 
 	// main
 	while (1) {
+		boot_mark (BOOT_LOOP);
 		tud_task(); 		// tinyusb device task
 		midi_task(&pedal);	// manage midi tasks
+		sysex_task();		// queue SysEx dumps for flash
+		preset_task();		// queue stored preset banks for flash
+		flash_writer_task();	// write queued pages to flash, one operation per loop
+
+		// stage 2: deferred init, one step per loop once device is mounted, so USB keeps being serviced
+		if (lazy_stage < 3) {
+			if (usb_tx_ready ()) lazy_init (lazy_stage++);
+			continue;
+		}
+
+		recorder_task(pedal.value != 0);	// flush event log to flash while idle, export event log
 
 		// manage neopixel led strip: light the strip with the right color; in case of black, wait 150ms before unlighting
 		switch (neoPixelState) {
 			case 0:
-				if (((to_us_since_boot (get_absolute_time()) - neoPixelOnTime)) > 150000) {	// paint to black after 150ms
+				if (((to_us_since_boot (get_absolute_time()) - neoPixelOnTime)) > preset->hold_us) {	// paint to black after hold time (150ms by default)
 					light_strip (rgb_to_color (0, 0, 0));	// black
 					neoPixelState = 3;						// next time do nothing
 				}
 				break;
 			case 1:
 				neoPixelOnTime = to_us_since_boot (get_absolute_time());
-				light_strip (rgb_to_color (255, 0, 0));		// red
+				light_strip (preset->color [0]);			// red by default
 				neoPixelState = 0;							// next state is black
 				break;
 			case 2:
 				neoPixelOnTime = to_us_since_boot (get_absolute_time());
-				light_strip (rgb_to_color (255, 255, 0));	// yellow
+				light_strip (preset->color [1]);			// yellow by default
 				neoPixelState = 0;							// next state is black
 				break;
 			default:
@@ -230,6 +229,41 @@ int main(void)
 	}
 }
 
+//--------------------------------------------------------------------+
+// Deferred init
+//--------------------------------------------------------------------+
+
+// boot phases timestamps
+uint32_t boot_time [BOOT_PHASES];
+
+// init steps which are not needed to send a note; called from the main loop once device is mounted
+void lazy_init (int step)
+{
+	uint offset;
+
+	switch (step) {
+		case 0:
+			stdio_init_all();
+			printf("MIDI-pedal\r\n");
+			break;
+		case 1:
+			// Neopixels inits
+			// Initialize PIO and load the WS2812 program
+			offset = (uint) pio_add_program (pio, &ws2812_program);
+			ws2812_program_init (pio, sm, offset, LED_PIN, 800000, false);
+			// End of NeoPixel inits
+			neoPixelState = 1;		// self-test: light neopixel, which is painted black after hold time
+			break;
+		case 2:
+			// find where to append to the event log in flash
+			recorder_init ();
+			boot_mark (BOOT_LAZY);
+			break;
+		default:
+			break;
+	}
+}
+
 //--------------------------------------------------------------------+
 // Device callbacks
 //--------------------------------------------------------------------+
@@ -237,13 +271,14 @@ int main(void)
 // Invoked when device is mounted
 void tud_mount_cb(void)
 {
-	//blink_interval_ms = BLINK_MOUNTED;
+	boot_mark (BOOT_MOUNT);
+	usb_mount (true);
 }
 
 // Invoked when device is unmounted
 void tud_umount_cb(void)
 {
-	//blink_interval_ms = BLINK_NOT_MOUNTED;
+	usb_mount (false);
 }
 
 // Invoked when usb bus is suspended
@@ -252,13 +287,13 @@ void tud_umount_cb(void)
 void tud_suspend_cb(bool remote_wakeup_en)
 {
 	(void) remote_wakeup_en;
-	//blink_interval_ms = BLINK_SUSPENDED;
+	usb_state_set (USB_SUSPENDED);
 }
 
 // Invoked when usb bus is resumed
 void tud_resume_cb(void)
 {
-	//blink_interval_ms = tud_mounted() ? BLINK_MOUNTED : BLINK_NOT_MOUNTED;
+	usb_state_set (tud_mounted() ? USB_MOUNTED : USB_UNMOUNTED);
 }
 
 //--------------------------------------------------------------------+
@@ -267,7 +302,10 @@ void tud_resume_cb(void)
 
 void midi_task(struct pedalboard *pd)
 {
-	uint8_t const cable_num = 0; // MIDI jack associated with USB endpoint
+	// active preset table; bank may change while reading packets below, so it is read again before sending
+	const struct preset_table *table = preset;
+	uint8_t note_on [4];
+	int i;
 
 	// note that we are using USB MIDI EVENTS: https://www.usb.org/sites/default/files/midi10.pdf
 	// these are 4-bytes messages supposed to describe any standard MIDI message
@@ -276,83 +314,106 @@ void midi_task(struct pedalboard *pd)
 	// regardless of these being used or not. Therefore incoming traffic should be read
 	// (possibly just discarded) to avoid the sender blocking in IO
 	// here, we check for note_on event, and if received, then we light the Neopixel strip
+	// SysEx packets received on the diagnostics cable are passed to the SysEx parser, which applies configuration changes on the fly
 	uint8_t packet[4];
 	bool read = false;
+	uint8_t rx;
 
-	while ( tud_midi_available() ) {
+	// packets are left in the FIFO while SysEx parser cannot accept more data (dump being written to flash)
+	while ( sysex_ready() && tud_midi_available() ) {
 		read = tud_midi_packet_read (packet);	// read midi EVENT
-		
+		if (!read) continue;
+		usb_rx_time = time_us_64();			// receive time of this packet, for the latency probe (SysEx ping)
+		recorder_log (REC_RX, packet);
+
 		// byte 0 = cable number | Code Index Number (CIN)
 		// byte 1 = MIDI 0 
 		// byte 2 = MIDI 1 
 		// byte 3 = MIDI 2
 		// CIN = 0x08 for note off, 0x09 for note on 
+		// CIN = 0x04 to 0x07 for SysEx, 0x0C for program change
+
+		// what is done with the packet depends on the cable it was received on (see usb_descriptors.h)
+		rx = usb_cable_rx [packet [0] >> 4];
+
+		// SysEx part
+		if (rx & USB_RX_SYSEX) {
+			sysex_parse_packet (packet);
+			continue;
+		}
+		if (!(rx & USB_RX_PLAY)) continue;
+
+		// program change on our channel selects preset bank: the new table is built aside, then swapped
+		if (((packet [0] & 0x0F) == CIN_PROGRAM) && (packet [1] == (MIDI_PROGRAM | (table->rx_note_on & 0x0F)))) {
+			preset_select (packet [2]);
+			table = preset;
+			continue;
+		}
+
+		// MIDI clock and start drive note repeat tempo; they are still passed thru
+		if ((packet [0] & 0x0F) == CIN_SINGLE_BYTE) repeat_clock (packet [1]);
+
+		// DIN thru: merge USB-received messages into DIN output
+		if (din_thru) din_send (packet);
 
 		// NeoPixel part
 		// test if note on, and velocity not null: in this case, lite the leds ON (in the while loop)
-		if (read) {
-			if ((packet [1] == (MIDI_NOTEON | CHANNEL)) && (packet [3] != 0)) {
-				if (packet [3] == 127) neoPixelState = 1;	// first beat (velocity == 127) is red
-				else neoPixelState = 2;						// other beats (other velocities) are yellow
-			}
-        }
+		if ((packet [1] == table->rx_note_on) && (packet [3] != 0)) {
+			if (packet [3] == 127) neoPixelState = 1;	// first beat (velocity == 127) is red
+			else neoPixelState = 2;						// other beats (other velocities) are yellow
+		}
 		// End of Neopixel part
     }
 
 
+	// once mounted, send switch events made while not mounted, if still young enough
+	replay_task ();
+
 	// test pedal and check if one of them is pressed
 	test_switch (SW1 | SW2 | SW3 | SW4 | SW5 | SW6 | SW7 | SW8, pd);
 
 	// check if state has changed, ie. pedal has just been pressed or unpressed
 	if (pd->change_state) {
 
-		uint8_t note_on[4] = { (cable_num << 4) | CIN_NOTEON, MIDI_NOTEON | CHANNEL, 0, 127 };
-
-		if (pd->value & SW1) {
-// if using stream_write instead of packet_write
-//			uint8_t note_on[3] = { MIDI_NOTEON | CHANNEL, 0, 127 };
-//			note_on[1] = NOTE_SW1;
-//			tud_midi_stream_write(cable_num, note_on, 3);
+		// all packets of this press are sent from the same table, even if bank is changed in the meantime
+		table = preset;
 
-			// Send Note On for current switch at full velocity (127) on channel.
-			note_on[2] = NOTE_SW1;
-			tud_midi_packet_write (note_on);
-		}
-		if (pd->value & SW2) {
-			// Send Note On for current switch at full velocity (127) on channel.
-			note_on[2] = NOTE_SW2;
-			tud_midi_packet_write (note_on);
-		}
-		if (pd->value & SW3) {
-			// Send Note On for current switch at full velocity (127) on channel.
-			note_on[2] = NOTE_SW3;
-			tud_midi_packet_write (note_on);
-		}
-		if (pd->value & SW4) {
-			// Send Note On for current switch at full velocity (127) on channel.
-			note_on[2] = NOTE_SW4;
-			tud_midi_packet_write (note_on);
-		}
-		if (pd->value & SW5) {
-		// Send Note On for current switch at full velocity (127) on channel.
-			note_on[2] = NOTE_SW5;
-			tud_midi_packet_write (note_on);
-		}
-		if (pd->value & SW6) {
-		// Send Note On for current switch at full velocity (127) on channel.
-			note_on[2] = NOTE_SW6;
-			tud_midi_packet_write (note_on);
-		}
-		if (pd->value & SW7) {
-		// Send Note On for current switch at full velocity (127) on channel.
-			note_on[2] = NOTE_SW7;
-			tud_midi_packet_write (note_on);
+		for (i = 0; i < NUM_SWITCHES; i++) {
+			// switch released: stop its repeat, if any
+			if (!(pd->value & (SW1 << i))) {
+				if (pd->change_value & (SW1 << i)) repeat_release (i);
+				continue;
+			}
+			// switch held and repeating: its notes are sent by the repeat engine
+			if (repeat_active (i)) continue;
+
+			// Send Note On for current switch at full velocity (127) on channel: packet is ready-made in table
+			// switch just pressed: start repeat, if on for this switch; in arpeggiator mode, first step may change the note
+			memcpy (note_on, table->note_on [i], sizeof (note_on));
+			if (!(pd->change_value & (SW1 << i))) repeat_press (i, table, note_on);
+
+			// DIN output gets it at once; if host has not configured the device yet, keep it for USB replay, unless the
+			// switch repeats: repeat events (its note-off among them) are not replayed, so the note would stick on the host
+			din_send (note_on);
+			if (!usb_tx_ready ()) {
+				if (!repeat_active (i)) replay_push (note_on);
+			}
+			else if (tud_midi_packet_write (note_on)) {
+				recorder_log (REC_TX, note_on);
+				usb_tx_done ();
+			}
 		}
-		if (pd->value & SW8) {
-		// Send Note On for current switch at full velocity (127) on channel.
-			note_on[2] = NOTE_SW8;
-			tud_midi_packet_write (note_on);
+	}
+
+	// then repeat events, a few per call so that they never delay fresh presses
+	// they are already on DIN output; they are not replayed once mounted, as they would be late
+	for (i = 0; (i < REPEAT_MAX_PER_LOOP) && repeat_peek (packet); i++) {
+		if (usb_tx_ready ()) {
+			if (!tud_midi_packet_write (packet)) break;		// FIFO full: try again on next call
+			recorder_log (REC_TX, packet);
+			usb_tx_done ();
 		}
+		repeat_pop ();
 	}
 }
 
@@ -365,7 +426,6 @@ int test_switch (int pedal_to_check, struct pedalboard* pedal)
 	int result = 0;
 	static int previous_result = 0;							// previous value for result, required for anti-bounce; this MUST BE static
 	static uint64_t this_press, previous_press = 0;			// time between 2 state changes; this MUST be static
-	int i;
 
 
 	// by default, we assume there is no change in the pedal state (ie. same pedals are pressed / unpressed as for previous function call)
@@ -409,6 +469,9 @@ int test_switch (int pedal_to_check, struct pedalboard* pedal)
 		result |= SW8;
 	}
 
+	// anti-bounce: switches are not read again until 50ms after a state change, without blocking the main loop
+	if (previous_press && (this_press - previous_press < DEBOUNCE_US)) result = previous_result;
+
 	// LED ON or LED OFF depending if a switch has been pressed
 	board_led_write(result ? true : false);
 
@@ -419,12 +482,6 @@ int test_switch (int pedal_to_check, struct pedalboard* pedal)
 		pedal->change_state = true;
 		pedal->change_value = previous_result;
 		previous_press = this_press;
-
-		// anti-bounce of 50ms
-		for (i = 0; i < 50; i++) {
-			// wait 1ms: not sure whether sleep or busy_wait are blocking background threads
-			sleep_ms (1);
-		}
 	}
 
 	// copy pedal values and return
@@ -0,0 +1,27 @@
+/*
+ * MIDI and USB-MIDI constants
+ * see https://www.usb.org/sites/default/files/midi10.pdf for USB-MIDI event packets
+ */
+
+#ifndef _MIDI_H_
+#define _MIDI_H_
+
+// MIDI constants
+#define MIDI_NOTEOFF	0x80
+#define MIDI_NOTEON		0x90
+#define MIDI_PROGRAM	0xC0
+#define MIDI_CLOCK		0xF8
+#define MIDI_START		0xFA
+#define MIDI_ACTIVE_SENSING	0xFE
+
+// USB-MIDI Code Index Numbers (CIN), low nibble of byte 0 of USB-MIDI packets
+#define CIN_NOTEOFF		0x8
+#define CIN_NOTEON		0x9
+#define CIN_PROGRAM		0xC
+#define CIN_SINGLE_BYTE	0xF
+
+// number of MIDI bytes carried by a USB-MIDI packet, indexed by CIN
+// (CIN 0x0 and 0x1 are reserved: the 3 bytes are kept)
+#define MIDI_CIN_LENGTHS	{ 3, 3, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1 }
+
+#endif /* _MIDI_H_ */
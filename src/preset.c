@@ -0,0 +1,109 @@
+/*
+ * Preset banks, see preset.h
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+#include "midi.h"
+#include "config.h"
+#include "preset.h"
+#include "flash_writer.h"
+#include "usb_descriptors.h"
+
+
+static struct pedal_config banks [NUM_BANKS];		// RAM copy of all banks
+static struct preset_table tables [2];				// active table, and shadow table being built
+const struct preset_table * volatile preset = &tables [0];
+static uint8_t current_bank = 0;
+
+// bank store: banks are queued to the flash writer one at a time, from preset_task()
+static uint8_t store_dirty = 0;					// banks waiting to be queued, one bit per bank
+
+
+// build table from configuration in shadow buffer, then make it active
+static void build_table (const struct pedal_config *cfg, uint8_t bank)
+{
+	struct preset_table *shadow = (preset == &tables [0]) ? &tables [1] : &tables [0];
+	int i;
+
+	shadow->bank = bank;
+	for (i = 0; i < NUM_SWITCHES; i++) {
+		shadow->note_on [i][0] = (usb_switch_cable [i] << 4) | CIN_NOTEON;	// cable of switch
+		shadow->note_on [i][1] = MIDI_NOTEON | cfg->channel;
+		shadow->note_on [i][2] = cfg->note [i];
+		shadow->note_on [i][3] = 127;									// full velocity
+	}
+	shadow->rx_note_on = MIDI_NOTEON | cfg->channel;
+	memcpy (shadow->color, cfg->color, sizeof (shadow->color));
+	shadow->hold_us = cfg->hold_us;
+	memcpy (shadow->repeat, cfg->repeat, sizeof (shadow->repeat));
+
+	// make sure table is complete before it is published
+	__dmb ();
+	preset = shadow;
+}
+
+// read all banks from flash, and use compile-time defaults for banks which have never been stored
+// flash is only read here: at boot, and after a SysEx dump; banks stored but not queued yet keep their RAM copy
+void preset_reload (void)
+{
+	const struct pedal_config *stored;
+	int i;
+
+	for (i = 0; i < NUM_BANKS; i++) {
+		if (store_dirty & (1u << i)) continue;
+		stored = (const struct pedal_config *) (XIP_BASE + PRESET_FLASH_OFFSET (i));
+		if (config_valid (stored)) memcpy (&banks [i], stored, sizeof (banks [i]));
+		else memcpy (&banks [i], &config_default, sizeof (banks [i]));
+	}
+	preset_select (current_bank);
+}
+
+void preset_init (void)
+{
+	current_bank = 0;
+	preset_reload ();
+}
+
+// make bank active; unsaved edits of the configuration are discarded
+void preset_select (uint8_t bank)
+{
+	if (bank >= NUM_BANKS) return;
+
+	current_bank = bank;
+	memcpy (&config, &banks [bank], sizeof (config));
+	build_table (&config, bank);
+}
+
+// make configuration being edited active
+void preset_apply (void)
+{
+	build_table (&config, current_bank);
+}
+
+// store configuration being edited into bank; flash is written later, from preset_task()
+void preset_store (uint8_t bank)
+{
+	if (bank >= NUM_BANKS) return;
+
+	memcpy (&banks [bank], &config, sizeof (banks [bank]));
+	store_dirty |= 1u << bank;
+}
+
+// queue banks being stored to the flash writer, one per call; called from the main loop
+// the RAM copy is taken when the bank is queued, so a bank stored again meanwhile is queued again afterwards
+void preset_task (void)
+{
+	uint8_t page [FLASH_PAGE_SIZE];
+	int bank;
+
+	if ((store_dirty == 0) || !flash_writer_room ()) return;
+
+	for (bank = 0; !(store_dirty & (1u << bank)); bank++) ;
+	memset (page, 0xFF, sizeof (page));
+	memcpy (page, &banks [bank], sizeof (banks [bank]));
+	if (flash_writer_queue (PRESET_FLASH_OFFSET (bank), page, true)) store_dirty &= ~(1u << bank);
+}
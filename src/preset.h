@@ -0,0 +1,45 @@
+/*
+ * Preset banks: each bank holds a complete configuration (see config.h), stored in its own flash sector.
+ *
+ * All banks are read from flash once at boot (and after a SysEx dump), and kept in RAM.
+ * The active bank is materialized into a lookup table with ready-made USB-MIDI packets; midi_task() only reads this table.
+ * Switching bank builds the new table in a shadow buffer, then swaps the table pointer: no flash access happens on
+ * the press-to-MIDI path, and a note being sent always uses a consistent table.
+ * Storing a bank into flash is deferred to preset_task(), called from the main loop, which queues it to the flash
+ * writer (see flash_writer.h).
+ */
+
+#ifndef _PRESET_H_
+#define _PRESET_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardware/flash.h"
+
+#include "config.h"
+
+#define NUM_BANKS				8
+#define PRESET_FLASH_OFFSET(b)	(CONFIG_FLASH_OFFSET + (uint32_t) (b) * FLASH_SECTOR_SIZE)	// flash offset of bank b
+
+// type definition
+struct preset_table {
+	uint8_t bank;							// bank this table was built from
+	uint8_t note_on [NUM_SWITCHES][4];		// USB-MIDI note-on packet sent for each switch
+	uint8_t rx_note_on;						// status byte of incoming note-on messages lighting the neopixel
+	uint32_t color [NUM_COLORS];			// neopixel colors
+	uint32_t hold_us;						// time neopixel stays lit, in us
+	struct repeat_config repeat [NUM_SWITCHES];	// note repeat settings of each switch
+};
+
+// active table; read it once, then use the local copy of the pointer for the whole operation
+extern const struct preset_table * volatile preset;
+
+// function prototypes
+void preset_init (void);
+void preset_reload (void);
+void preset_select (uint8_t);
+void preset_apply (void);
+void preset_store (uint8_t);
+void preset_task (void);
+
+#endif /* _PRESET_H_ */
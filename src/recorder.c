@@ -0,0 +1,660 @@
+/*
+ * MIDI event recorder, see recorder.h for the record format
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "tusb.h"
+
+#include "midi.h"
+#include "sysex.h"
+#include "usb_state.h"
+#include "recorder.h"
+#include "flash_writer.h"
+#include "usb_descriptors.h"
+
+
+#define REC_ESCAPE			0xF4		// marks a record which is not a channel voice message
+#define REC_CABLE			0xF5		// cable change before a channel voice message
+#define REC_MAX_RECORD		16			// 10 bytes varint, escape, byte 0, 3 MIDI bytes (or cable change, 3 MIDI bytes)
+#define REC_FLASH_PAGES		(RECORDER_FLASH_SIZE / FLASH_PAGE_SIZE)
+#define REC_SECTOR_PAGES	(FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define SMF_DIVISION		500			// ticks per quarter note; at default tempo (120 bpm), 1 tick = 1 ms
+#define EXPORT_PACKETS_PER_MS	8		// export rate, half of what full speed USB can carry: leaves room in the TX FIFO
+#define EXPORT_MEASURE_RECORDS	64		// records decoded per recorder_task() call while measuring track lengths
+
+static const uint8_t cin_length [16] = MIDI_CIN_LENGTHS;
+
+// type definition
+struct rec_state {
+	uint64_t time;					// time of last decoded record, in us
+	uint8_t running [2];			// running status for each direction
+	uint8_t cable [2];				// cable of last channel voice message, for each direction
+};
+
+struct rec_event {
+	uint64_t time;
+	uint8_t dir;
+	uint8_t packet [4];
+};
+
+// flash page: header holding decoding state at first record, then records
+struct rec_page {
+	uint32_t magic;					// RECORDER_MAGIC when page is valid
+	uint32_t seq;					// page sequence number, increasing
+	uint64_t time;
+	uint8_t running [2];
+	uint8_t cable [2];
+	uint16_t len;					// number of bytes of records in page
+	uint8_t data [FLASH_PAGE_SIZE - 22];
+};
+
+// iterator over records, either in RAM ring or in flash pages
+struct rec_iter {
+	uint8_t (*get) (uint32_t);		// byte access function
+	uint32_t pos;					// current record
+	uint32_t end;					// end of records in ring or flash page
+	struct rec_state st;
+	uint32_t page;					// flash: page being decoded
+	uint32_t pages_left;			// flash: number of pages not decoded yet
+};
+
+
+struct recorder_stats recorder_stats;
+
+// RAM ring; positions are free-running, and wrapped on access
+static uint8_t ring [RECORDER_SIZE];
+static uint32_t head = 0;					// where next record is written
+static uint32_t tail = 0;					// oldest record
+static struct rec_state head_state;			// encoding state
+static struct rec_state tail_state;			// decoding state at oldest record
+static uint64_t last_activity = 0;			// time of last packet, logged or counted
+
+// flush to flash
+static bool flush_enabled = RECORDER_FLASH_FLUSH;
+static struct rec_page flush_page;			// page waiting for room in the flash writer queue
+static bool flush_pending = false;
+static uint32_t flush_pos = 0;				// first record not flushed yet
+static struct rec_state flush_state;		// decoding state at flush_pos
+static uint32_t flash_page_idx = 0;			// next page to be written in flash region
+static uint32_t flash_seq = 0;				// sequence number of next page
+static uint32_t erased_pages = 0;			// pages from flash_page_idx on which are erased, and may be written
+
+// export
+static bool exporting = false;				// while exporting, ring tail and flash pages are frozen
+static uint8_t exp_src;
+static uint32_t exp_end;					// RAM: end of records exported; records logged during export are left out
+static uint8_t exp_track;					// track being exported, REC_TX or REC_RX
+static uint32_t exp_track_len [2];
+static uint64_t exp_measure_ms [2];			// time of previous event in each track, while measuring track lengths
+static uint64_t exp_base_ms;				// time of first event in log
+static uint64_t exp_prev_ms;				// time of previous event in track
+static struct rec_iter exp_it;
+static int exp_phase;
+static uint8_t exp_buf [16];				// SMF bytes being sent
+static int exp_n, exp_i;
+static int exp_sx_phase;
+static uint8_t exp_group [8];				// 7-in-8 group being sent
+static int exp_group_n, exp_group_i;
+static uint8_t exp_packet [4];				// USB-MIDI packet waiting for room in TX FIFO
+static bool exp_packet_ready = false;
+static uint64_t exp_time;					// time of last rate limit credit
+static int exp_credit;
+
+
+//--------------------------------------------------------------------+
+// Record encoding and decoding
+//--------------------------------------------------------------------+
+
+static uint8_t ring_get (uint32_t pos)
+{
+	return ring [pos & (RECORDER_SIZE - 1)];
+}
+
+static uint8_t flash_get (uint32_t pos)
+{
+	return ((const uint8_t *) (XIP_BASE + RECORDER_FLASH_OFFSET)) [pos];
+}
+
+static const struct rec_page *flash_page (uint32_t page)
+{
+	return (const struct rec_page *) (XIP_BASE + RECORDER_FLASH_OFFSET + page * FLASH_PAGE_SIZE);
+}
+
+// number of data bytes of a channel voice message
+static int data_length (uint8_t status)
+{
+	return ((status & 0xE0) == 0xC0) ? 1 : 2;		// program change and channel pressure have 1 data byte
+}
+
+// channel voice message, on any cable: may use running status
+static bool is_channel_voice (uint8_t const packet[4])
+{
+	uint8_t cin = packet [0] & 0x0F;
+
+	return (cin >= CIN_NOTEOFF) && (cin <= 0xE) && ((packet [1] >> 4) == cin);
+}
+
+// decode record at pos, update decoding state; return position of next record
+static uint32_t decode (uint8_t (*get) (uint32_t), uint32_t pos, struct rec_state *st, struct rec_event *ev)
+{
+	uint64_t v = 0;
+	int shift = 0;
+	uint8_t b;
+	int i;
+
+	do {
+		b = get (pos++);
+		if (shift < 64) v |= (uint64_t) (b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	ev->dir = v & 1;
+	st->time += v >> 1;
+	ev->time = st->time;
+	memset (ev->packet, 0, sizeof (ev->packet));
+
+	b = get (pos);
+	if (b == REC_ESCAPE) {
+		pos++;
+		ev->packet [0] = get (pos++);
+		for (i = 0; i < cin_length [ev->packet [0] & 0x0F]; i++) ev->packet [1 + i] = get (pos++);
+		return pos;
+	}
+
+	if (b == REC_CABLE) {
+		st->cable [ev->dir] = get (pos + 1);
+		pos += 2;
+		b = get (pos);
+	}
+	if (b & 0x80) {
+		st->running [ev->dir] = b;
+		pos++;
+	}
+	b = st->running [ev->dir];
+	ev->packet [0] = (st->cable [ev->dir] << 4) | (b >> 4);
+	ev->packet [1] = b;
+	ev->packet [2] = get (pos++);
+	if (data_length (b) == 2) ev->packet [3] = get (pos++);
+	return pos;
+}
+
+// drop oldest record of the ring
+static void drop_oldest (void)
+{
+	struct rec_event ev;
+	uint32_t old = tail;
+
+	tail = decode (ring_get, tail, &tail_state, &ev);
+
+	// record was not flushed yet: it is lost for flash too
+	if (flush_pos == old) {
+		flush_pos = tail;
+		flush_state = tail_state;
+	}
+}
+
+// log a packet sent (REC_TX) or received (REC_RX)
+void recorder_log (uint8_t dir, uint8_t const packet[4])
+{
+	uint8_t rec [REC_MAX_RECORD];
+	uint64_t now = time_us_64 ();
+	uint64_t v = ((now - head_state.time) << 1) | dir;
+	bool running = is_channel_voice (packet);
+	uint32_t n = 0;
+	uint32_t i;
+
+	last_activity = now;
+
+	// MIDI clock and active sensing are only counted (they are not exported either)
+	if (((packet [0] & 0x0F) == CIN_SINGLE_BYTE) && ((packet [1] == MIDI_CLOCK) || (packet [1] == MIDI_ACTIVE_SENSING))) {
+		recorder_stats.realtime++;
+		return;
+	}
+	// so is SysEx on the diagnostics cable (CIN 0x4 to 0x7); a message is counted on its last packet
+	if (((packet [0] >> 4) == CABLE_DIAG) && ((packet [0] & 0x0F) >= 0x4) && ((packet [0] & 0x0F) <= 0x7)) {
+		if ((packet [0] & 0x0F) != 0x4) recorder_stats.sysex++;
+		return;
+	}
+
+	// time delta and direction
+	do {
+		rec [n] = v & 0x7F;
+		v >>= 7;
+		if (v) rec [n] |= 0x80;
+		n++;
+	} while (v);
+
+	// message
+	if (running) {
+		if ((packet [0] >> 4) != head_state.cable [dir]) {
+			rec [n++] = REC_CABLE;
+			rec [n++] = packet [0] >> 4;
+		}
+		if (packet [1] != head_state.running [dir]) rec [n++] = packet [1];
+		rec [n++] = packet [2] & 0x7F;
+		if (data_length (packet [1]) == 2) rec [n++] = packet [3] & 0x7F;
+	}
+	else {
+		rec [n++] = REC_ESCAPE;
+		rec [n++] = packet [0];
+		for (i = 0; i < cin_length [packet [0] & 0x0F]; i++) rec [n++] = packet [1 + i];
+	}
+
+	// make room by dropping oldest records, unless they are being exported
+	while (RECORDER_SIZE - (head - tail) < n) {
+		if (exporting) {
+			recorder_stats.lost++;
+			return;
+		}
+		drop_oldest ();
+	}
+
+	for (i = 0; i < n; i++) ring [(head + i) & (RECORDER_SIZE - 1)] = rec [i];
+	head += n;
+	head_state.time = now;
+	if (running) {
+		head_state.running [dir] = packet [1];
+		head_state.cable [dir] = packet [0] >> 4;
+	}
+}
+
+
+//--------------------------------------------------------------------+
+// Iteration over records in RAM or flash
+//--------------------------------------------------------------------+
+
+static bool iter_load_page (struct rec_iter *it)
+{
+	const struct rec_page *p = flash_page (it->page);
+
+	if ((p->magic != RECORDER_MAGIC) || (p->len > sizeof (p->data))) return false;
+
+	it->pos = it->page * FLASH_PAGE_SIZE + offsetof (struct rec_page, data);
+	it->end = it->pos + p->len;
+	it->st.time = p->time;
+	memcpy (it->st.running, p->running, sizeof (it->st.running));
+	memcpy (it->st.cable, p->cable, sizeof (it->st.cable));
+	return true;
+}
+
+static void iter_start (struct rec_iter *it, uint8_t src)
+{
+	uint32_t i;
+	uint32_t min_seq = 0xFFFFFFFF;
+
+	if (src == REC_SRC_RAM) {
+		it->get = ring_get;
+		it->pos = tail;
+		it->end = exp_end;
+		it->st = tail_state;
+		it->pages_left = 0;
+		return;
+	}
+
+	// flash: start from oldest valid page, then go through all pages in order
+	it->get = flash_get;
+	it->pos = it->end = 0;
+	it->page = 0;
+	for (i = 0; i < REC_FLASH_PAGES; i++) {
+		if ((flash_page (i)->magic == RECORDER_MAGIC) && (flash_page (i)->seq < min_seq)) {
+			min_seq = flash_page (i)->seq;
+			it->page = i;
+		}
+	}
+	it->pages_left = (min_seq == 0xFFFFFFFF) ? 0 : REC_FLASH_PAGES;
+	it->page = (it->page + REC_FLASH_PAGES - 1) % REC_FLASH_PAGES;		// incremented when first page is loaded
+}
+
+static bool iter_next (struct rec_iter *it, struct rec_event *ev)
+{
+	while (it->pos == it->end) {
+		if (it->pages_left == 0) return false;
+		it->pages_left--;
+		it->page = (it->page + 1) % REC_FLASH_PAGES;
+		if (!iter_load_page (it)) it->pos = it->end;
+	}
+	it->pos = decode (it->get, it->pos, &it->st, ev);
+	return true;
+}
+
+
+//--------------------------------------------------------------------+
+// Flush to flash
+//--------------------------------------------------------------------+
+
+void recorder_flush_enable (bool enable)
+{
+	flush_enabled = enable;
+}
+
+// fill flush page with records not flushed yet; only full pages are written, to save flash
+static void flush_build (void)
+{
+	struct rec_event ev;
+	struct rec_state st = flush_state;
+	struct rec_state next_st;
+	uint32_t pos = flush_pos;
+	uint32_t next;
+	uint32_t len = 0;
+
+	if (head - flush_pos < sizeof (flush_page.data)) return;
+
+	flush_page.magic = RECORDER_MAGIC;
+	flush_page.seq = flash_seq;
+	flush_page.time = st.time;
+	memcpy (flush_page.running, st.running, sizeof (flush_page.running));
+	memcpy (flush_page.cable, st.cable, sizeof (flush_page.cable));
+
+	while (pos != head) {
+		next_st = st;
+		next = decode (ring_get, pos, &next_st, &ev);
+		if (len + (next - pos) > sizeof (flush_page.data)) break;
+		while (pos != next) flush_page.data [len++] = ring_get (pos++);
+		st = next_st;
+	}
+	memset (&flush_page.data [len], 0xFF, sizeof (flush_page.data) - len);
+	flush_page.len = len;
+
+	flush_pos = pos;
+	flush_state = st;
+	flush_pending = true;
+}
+
+// queue flush page to the flash writer, once its page has been erased
+static void flush_write (void)
+{
+	uint32_t offset = RECORDER_FLASH_OFFSET + flash_page_idx * FLASH_PAGE_SIZE;
+
+	if (erased_pages == 0) return;
+	if (!flash_writer_queue (offset, (const uint8_t *) &flush_page, false)) return;
+
+	flush_pending = false;
+	flash_page_idx = (flash_page_idx + 1) % REC_FLASH_PAGES;
+	flash_seq++;
+	erased_pages--;
+}
+
+// erase next sector ahead of the log, only while idle (see recorder.h); its oldest pages are lost
+static void flush_erase (bool playing)
+{
+	uint32_t page = (flash_page_idx + erased_pages) % REC_FLASH_PAGES;
+
+	if (playing || (time_us_64 () - last_activity < RECORDER_IDLE_US)) return;
+	if ((erased_pages + REC_SECTOR_PAGES) * FLASH_PAGE_SIZE > RECORDER_ERASE_AHEAD) return;
+
+	if (flash_writer_erase (RECORDER_FLASH_OFFSET + page * FLASH_PAGE_SIZE)) erased_pages += REC_SECTOR_PAGES;
+}
+
+
+//--------------------------------------------------------------------+
+// Export as Standard MIDI File
+//--------------------------------------------------------------------+
+
+// SMF variable-length quantity, most significant first; return number of bytes
+static int smf_varint (uint8_t *buf, uint32_t v)
+{
+	int n = 0;
+	int i;
+
+	if (v > 0x0FFFFFFF) v = 0x0FFFFFFF;
+	for (i = 21; i > 0; i -= 7) {
+		if ((v >> i) || n) buf [n++] = ((v >> i) & 0x7F) | 0x80;
+	}
+	buf [n++] = v & 0x7F;
+	return n;
+}
+
+// SMF delta time in ticks (ms) of event; time going backwards (log from several sessions in flash) gives 0
+static uint32_t smf_delta (struct rec_event const *ev, uint64_t *prev_ms)
+{
+	uint64_t ms = ev->time / 1000;
+	uint32_t delta = (ms > *prev_ms) ? (uint32_t) (ms - *prev_ms) : 0;
+
+	*prev_ms = ms;
+	return delta;
+}
+
+enum {
+	EXP_START,
+	EXP_MEASURE,
+	EXP_HEADER,
+	EXP_TRACK,
+	EXP_EVENTS,
+	EXP_DONE,
+};
+
+// fill export buffer with next SMF bytes
+static void smf_fill (void)
+{
+	struct rec_event ev;
+	static const uint8_t header [] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 2, SMF_DIVISION >> 8, SMF_DIVISION & 0xFF };
+	static const uint8_t end_of_track [] = { 0, 0xFF, 0x2F, 0 };
+
+	exp_n = exp_i = 0;
+	switch (exp_phase) {
+		case EXP_HEADER:
+			memcpy (exp_buf, header, sizeof (header));
+			exp_n = sizeof (header);
+			exp_track = REC_TX;
+			exp_phase = EXP_TRACK;
+			break;
+
+		case EXP_TRACK:
+			memcpy (exp_buf, "MTrk", 4);
+			exp_buf [4] = exp_track_len [exp_track] >> 24;
+			exp_buf [5] = exp_track_len [exp_track] >> 16;
+			exp_buf [6] = exp_track_len [exp_track] >> 8;
+			exp_buf [7] = exp_track_len [exp_track];
+			exp_n = 8;
+			iter_start (&exp_it, exp_src);
+			exp_prev_ms = exp_base_ms;
+			exp_phase = EXP_EVENTS;
+			break;
+
+		case EXP_EVENTS:
+			while (iter_next (&exp_it, &ev)) {
+				if ((ev.dir != exp_track) || !is_channel_voice (ev.packet)) continue;
+				exp_n = smf_varint (exp_buf, smf_delta (&ev, &exp_prev_ms));
+				exp_buf [exp_n++] = ev.packet [1];
+				exp_buf [exp_n++] = ev.packet [2];
+				if (data_length (ev.packet [1]) == 2) exp_buf [exp_n++] = ev.packet [3];
+				return;
+			}
+			memcpy (exp_buf, end_of_track, sizeof (end_of_track));
+			exp_n = sizeof (end_of_track);
+			if (exp_track == REC_TX) {
+				exp_track = REC_RX;
+				exp_phase = EXP_TRACK;
+			}
+			else exp_phase = EXP_DONE;
+			break;
+
+		default:
+			break;
+	}
+}
+
+// next SMF byte, -1 when file is complete
+static int smf_byte (void)
+{
+	if (exp_i == exp_n) {
+		if (exp_phase == EXP_DONE) return -1;
+		smf_fill ();
+	}
+	return exp_buf [exp_i++];
+}
+
+// next SysEx byte: F0 7D 20 <SMF bytes packed 7-in-8> F7; -1 when message is complete
+static int sysex_byte (void)
+{
+	int b;
+	int i;
+
+	switch (exp_sx_phase) {
+		case 0:
+			exp_sx_phase++;
+			return SYSEX_START;
+		case 1:
+			exp_sx_phase++;
+			return SYSEX_ID;
+		case 2:
+			exp_sx_phase++;
+			exp_group_n = exp_group_i = 0;
+			return SYSEX_EXPORT;
+		case 3:
+			if (exp_group_i == exp_group_n) {
+				// next group: byte with bit 7 of up to 7 SMF bytes, then these bytes
+				exp_group [0] = 0;
+				for (i = 0; i < 7; i++) {
+					b = smf_byte ();
+					if (b < 0) break;
+					exp_group [0] |= (b >> 7) << i;
+					exp_group [1 + i] = b & 0x7F;
+				}
+				if (i == 0) {
+					exp_sx_phase++;
+					return SYSEX_END;
+				}
+				exp_group_n = i + 1;
+				exp_group_i = 0;
+			}
+			return exp_group [exp_group_i++];
+		default:
+			return -1;
+	}
+}
+
+// measure length of both tracks, as they are needed before the first event is sent
+// a few records are decoded per call, so that a whole flash log does not stall the main loop
+static void smf_measure (void)
+{
+	struct rec_iter it;
+	struct rec_event ev;
+	uint8_t buf [4];
+	int i;
+
+	if (exp_phase == EXP_START) {
+		iter_start (&exp_it, exp_src);
+		it = exp_it;
+		exp_base_ms = iter_next (&it, &ev) ? ev.time / 1000 : 0;
+		exp_measure_ms [REC_TX] = exp_measure_ms [REC_RX] = exp_base_ms;
+		exp_track_len [REC_TX] = exp_track_len [REC_RX] = 4;		// end of track
+		exp_phase = EXP_MEASURE;
+		return;
+	}
+
+	for (i = 0; i < EXPORT_MEASURE_RECORDS; i++) {
+		if (!iter_next (&exp_it, &ev)) {
+			exp_phase = EXP_HEADER;
+			return;
+		}
+		if (!is_channel_voice (ev.packet)) continue;
+		exp_track_len [ev.dir] += smf_varint (buf, smf_delta (&ev, &exp_measure_ms [ev.dir])) + 1 + data_length (ev.packet [1]);
+	}
+}
+
+// start streaming log out as a SysEx message holding a SMF; track lengths are measured first, from recorder_task()
+void recorder_export (uint8_t src)
+{
+	if (exporting) return;
+
+	exp_src = (src == REC_SRC_FLASH) ? REC_SRC_FLASH : REC_SRC_RAM;
+	exp_end = head;			// same end for track lengths and track data (tail does not move during export)
+
+	exp_phase = EXP_START;
+	exp_n = exp_i = 0;
+	exp_sx_phase = 0;
+	exp_packet_ready = false;
+	exp_time = time_us_64 ();
+	exp_credit = EXPORT_PACKETS_PER_MS;
+	exporting = true;
+}
+
+// true while an export is being streamed: no other SysEx message may be sent on its cable
+bool recorder_exporting (void)
+{
+	return exporting;
+}
+
+// send export packets, within rate limit and as long as there is room in the TX FIFO
+static void export_send (void)
+{
+	uint64_t now = time_us_64 ();
+	int b;
+	int i;
+
+	if (now - exp_time >= 1000) {
+		exp_time = now;
+		exp_credit = EXPORT_PACKETS_PER_MS;
+	}
+
+	// nothing is sent while not mounted; export resumes once mounted
+	while ((exp_credit > 0) && usb_tx_ready ()) {
+		if (!exp_packet_ready) {
+			memset (exp_packet, 0, sizeof (exp_packet));
+			for (i = 0; i < 3; i++) {
+				b = sysex_byte ();
+				if (b < 0) break;
+				exp_packet [1 + i] = b;
+				if (b == SYSEX_END) {
+					i++;
+					break;
+				}
+			}
+			if (i == 0) {
+				exporting = false;
+				return;
+			}
+			// CIN 0x4: SysEx starts or continues; 0x5 to 0x7: SysEx ends with 1 to 3 bytes; sent on diagnostics cable
+			exp_packet [0] = (CABLE_DIAG << 4) | ((exp_packet [i] == SYSEX_END) ? 0x4 + i : 0x4);
+			exp_packet_ready = true;
+		}
+		if (!tud_midi_packet_write (exp_packet)) return;
+		exp_packet_ready = false;
+		exp_credit--;
+	}
+}
+
+
+//--------------------------------------------------------------------+
+// Init and task
+//--------------------------------------------------------------------+
+
+// find where to append to the flash log
+void recorder_init (void)
+{
+	const struct rec_page *p;
+	uint32_t i;
+	bool found = false;
+
+	for (i = 0; i < REC_FLASH_PAGES; i++) {
+		p = flash_page (i);
+		if ((p->magic == RECORDER_MAGIC) && (!found || (p->seq >= flash_seq))) {
+			flash_seq = p->seq + 1;
+			flash_page_idx = (i + 1) % REC_FLASH_PAGES;
+			found = true;
+		}
+	}
+
+	// pages are written in order after their sector is erased: rest of the sector of the last page is still erased
+	erased_pages = (REC_SECTOR_PAGES - flash_page_idx % REC_SECTOR_PAGES) % REC_SECTOR_PAGES;
+}
+
+// called from the main loop; playing: a switch is held
+void recorder_task (bool playing)
+{
+	if (exporting) {
+		if ((exp_phase == EXP_START) && (exp_src == REC_SRC_FLASH) && !flash_writer_idle ()) return;	// pages being written
+		if (exp_phase < EXP_HEADER) smf_measure ();
+		else export_send ();
+		return;				// flash log is frozen during export
+	}
+
+	if (!flush_enabled) return;
+	flush_erase (playing);
+	if (flush_pending) flush_write ();
+	else flush_build ();
+}
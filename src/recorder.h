@@ -0,0 +1,73 @@
+/*
+ * MIDI event recorder: every USB-MIDI packet sent or received by midi_task() is logged with its timestamp,
+ * for post-show debugging.
+ * MIDI clock and active sensing, and SysEx on the diagnostics cable, are only counted: a clock tick every 20ms
+ * (120 bpm) would fill the ring within a minute, and a single dump would fill most of it. Counts are returned by SysEx.
+ *
+ * Events are stored in a RAM ring, oldest events being dropped when the ring is full. Each record is:
+ *   varint (delta_us << 1 | dir)		time since previous record in us, and direction (0: TX, 1: RX);
+ *										7 bits per byte, least significant first, bit 7 set when more bytes follow
+ *   [F5 cable] [status] data1 [data2]	channel voice messages; F5 (undefined in MIDI, never sent) then cable number
+ *										are only written when the cable is not the same as for the previous channel voice
+ *										message in the same direction; status is omitted when it is the same as the
+ *										previous one in the same direction (running status), whatever the cable
+ * or
+ *   F4 byte0 bytes...					any other packet: F4 (undefined in MIDI, never sent), then byte 0 of the USB-MIDI
+ *										packet (cable | CIN), then the MIDI bytes carried by the packet
+ *
+ * The ring may optionally be flushed in the background to a reserved flash region, page by page (see flash_writer.h). Each page starts with
+ * a header holding the decoding state at its first record, so pages can be decoded on their own.
+ * Pages are only written into flash erased ahead of time, while the pedal is idle (no switch held, no packet for
+ * RECORDER_IDLE_US): a sector erase disables interrupts for tens of ms, up to 400ms, which would stall switches, note
+ * repeat and DIN output. While playing, flush waits once the erased flash is used up; if the ring wraps meanwhile,
+ * its oldest records are lost for flash too.
+ *
+ * The log (from RAM or flash) is streamed out as a Standard MIDI File on SysEx request (see sysex.h): format 1,
+ * track 0 holds TX events and track 1 RX events, 1 tick = 1 ms. Only channel voice messages are exported, from all cables.
+ */
+
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardware/flash.h"
+
+#include "config.h"
+
+#define RECORDER_SIZE			(16 * 1024)		// RAM ring size; must be a power of 2
+#define RECORDER_FLASH_FLUSH	false			// flush ring to flash by default
+
+// flash region reserved for recorder, just below configuration region
+#define RECORDER_FLASH_SIZE		(256 * 1024)
+#define RECORDER_FLASH_OFFSET	(CONFIG_FLASH_OFFSET - RECORDER_FLASH_SIZE)
+#define RECORDER_MAGIC			0x52454332		// "REC2"
+#define RECORDER_ERASE_AHEAD	(64 * 1024)		// flash erased ahead of the log while idle; oldest pages are lost
+#define RECORDER_IDLE_US		2000000			// no packet for 2s and no switch held: flash may be erased
+
+// directions
+#define REC_TX		0
+#define REC_RX		1
+
+// log sources for export
+#define REC_SRC_RAM		0
+#define REC_SRC_FLASH	1
+
+// type definition
+struct recorder_stats {
+	uint32_t realtime;				// MIDI clock and active sensing messages, counted but not logged
+	uint32_t sysex;					// SysEx messages on the diagnostics cable, counted but not logged
+	uint32_t lost;					// records not logged because ring was full during an export
+};
+
+extern struct recorder_stats recorder_stats;
+
+// function prototypes
+void recorder_init (void);
+void recorder_log (uint8_t, uint8_t const packet[4]);
+void recorder_flush_enable (bool);
+void recorder_export (uint8_t);
+bool recorder_exporting (void);
+void recorder_task (bool);
+
+#endif /* _RECORDER_H_ */
@@ -0,0 +1,338 @@
+/*
+ * Note repeat / arpeggiator, see repeat.h
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/timer.h"
+#include "hardware/sync.h"
+
+#include "midi.h"
+#include "config.h"
+#include "preset.h"
+#include "din_midi.h"
+#include "repeat.h"
+
+
+// type definition
+struct repeat_slot {
+	bool active;					// switch is held and repeat is on
+	bool sounding;					// a note-on has been sent, note-off is next
+	uint8_t step;					// arpeggiator step
+	uint8_t note_on [4];			// note-on packet of switch, copied on press
+	uint8_t note;					// note sounding
+	struct repeat_config cfg;		// settings, copied on press
+	uint64_t step_time;				// time of note-on of current step
+	uint64_t next;					// time of next event
+	uint32_t step_tick;				// following MIDI clock: tick of next step, counted since MIDI start
+};
+
+static struct repeat_slot slots [NUM_SWITCHES];
+
+uint32_t repeat_skipped = 0;				// steps skipped because event ring or DIN ring was too full
+
+// event ring, written by alarm callback (or with interrupts disabled), read by midi_task()
+// an entry is reserved for the note-off of each sounding note, so that note-offs are never dropped
+static uint8_t events [REPEAT_EVENTS][4];
+static volatile uint32_t ev_head = 0;
+static volatile uint32_t ev_tail = 0;
+static uint32_t ev_reserved = 0;			// entries reserved for note-offs
+
+static int alarm_num;
+static volatile uint32_t tick_us = 0;		// MIDI clock tick period, filtered; 0 if no clock is being received
+static uint64_t last_tick = 0;				// time last tick was received
+static uint64_t clock_time = 0;				// predicted time of last tick, corrected by each tick received
+static uint32_t ticks = 0;					// MIDI clock ticks received since MIDI start
+
+
+// steps of slot are triggered by MIDI clock ticks, rather than by the alarm
+static bool clocked (struct repeat_slot const *s)
+{
+	return s->cfg.clock_div && tick_us;
+}
+
+// step period; when following MIDI clock, it is only used for gate length
+static uint32_t period_of (struct repeat_slot const *s)
+{
+	uint32_t period = s->cfg.period_us;
+
+	if (clocked (s)) period = tick_us * s->cfg.clock_div;
+	return (period < REPEAT_MIN_PERIOD_US) ? REPEAT_MIN_PERIOD_US : period;
+}
+
+// predicted time of tick k (counted since MIDI start), from the last tick received and the tick period
+static uint64_t tick_time (uint32_t k)
+{
+	return clock_time + (int64_t) (int32_t) (k - (ticks - 1)) * tick_us;
+}
+
+// first tick from tick k on which starts a step of slot
+static uint32_t align_tick (struct repeat_slot const *s, uint32_t k)
+{
+	return k + (s->cfg.clock_div - k % s->cfg.clock_div) % s->cfg.clock_div;
+}
+
+// no tick for a few tick periods: clock has stopped, slots following it go on at their fixed period
+static void check_clock (uint64_t now)
+{
+	if (tick_us && (now - last_tick > REPEAT_CLOCK_TIMEOUT * tick_us)) tick_us = 0;
+}
+
+// time of next step, once current note is off; when following MIDI clock, predicted time of its tick
+static uint64_t next_step (struct repeat_slot const *s, uint32_t period)
+{
+	return clocked (s) ? tick_time (s->step_tick) : s->step_time + period;
+}
+
+static uint32_t gate_of (struct repeat_slot const *s, uint32_t period)
+{
+	uint32_t gate = period / 100 * s->cfg.gate;
+
+	if (gate < REPEAT_MIN_GATE_US) gate = REPEAT_MIN_GATE_US;
+	if (gate > period - REPEAT_MIN_GATE_US) gate = period - REPEAT_MIN_GATE_US;
+	return gate;
+}
+
+// reserve room for the note-off of a note about to sound, in event ring and DIN ring; false if there is no room
+// press: note-on is the switch press, sent by midi_task(); otherwise it is a step, which needs an event ring entry too
+static bool reserve (bool press)
+{
+	if (REPEAT_EVENTS - (ev_head - ev_tail) < ev_reserved + (press ? 1 : 2)) return false;
+	if (!din_reserve (press)) return false;
+	ev_reserved++;
+	return true;
+}
+
+// queue event for USB, sent from midi_task(); room has been checked by reserve()
+static void push (uint8_t const packet[4])
+{
+	memcpy (events [ev_head % REPEAT_EVENTS], packet, 4);
+	ev_head++;
+}
+
+// DIN output gets the event at once; USB gets it from midi_task()
+static void note_on (struct repeat_slot *s)
+{
+	uint8_t packet [4] = { s->note_on [0], s->note_on [1], s->note, s->note_on [3] };
+
+	din_send (packet);
+	push (packet);
+	s->sounding = true;
+}
+
+// note-off uses the room reserved when the note started; it is sent as a note-on with velocity 0, so that DIN output
+// keeps running status: a step then takes 4 bytes instead of 6
+static void note_off (struct repeat_slot *s)
+{
+	uint8_t packet [4] = { s->note_on [0], s->note_on [1], s->note, 0 };
+
+	din_send_reserved (packet);
+	push (packet);
+	ev_reserved--;
+	s->sounding = false;
+}
+
+// note of current step: switch note, offset by step interval in arpeggiator mode
+static uint8_t step_note (struct repeat_slot const *s)
+{
+	int note = s->note_on [2];
+
+	if (s->cfg.mode == REPEAT_ARP) note += s->cfg.interval [s->step];
+	if (note < 0) note = 0;
+	if (note > 127) note = 127;
+	return (uint8_t) note;
+}
+
+// start next step at time t: note-on of next note
+static void start_step (struct repeat_slot *s, uint64_t t, uint32_t period)
+{
+	s->step_time = t;
+	s->step = (s->step + 1) % s->cfg.steps;
+	if (clocked (s)) s->step_tick += s->cfg.clock_div;
+
+	// no room for the note-on and its note-off: skip this step rather than risk a stuck note
+	if (!reserve (false)) {
+		repeat_skipped++;
+		s->next = next_step (s, period);
+		return;
+	}
+	s->note = step_note (s);
+	note_on (s);
+	s->next = s->step_time + gate_of (s, period);
+}
+
+// send due event of slot, if any: at most one event per call
+static void run_slot (struct repeat_slot *s, uint64_t now)
+{
+	uint32_t period;
+
+	if (!s->active || (s->next > now)) return;
+
+	if (s->sounding) {
+		note_off (s);
+		s->next = next_step (s, period_of (s));
+		return;
+	}
+
+	// step due while following MIDI clock: it is played at its predicted time, unless ticks have stopped coming
+	if (s->cfg.clock_div) check_clock (now);
+	period = period_of (s);
+
+	// next step; if late by more than half a period (eg. interrupts disabled during a flash write),
+	// restart from now rather than sending a burst of late notes
+	start_step (s, (now - s->next > period / 2) ? now : s->next, period);
+}
+
+// send due events, and set alarm to the earliest next event; cost is bounded by the number of switches
+// called from alarm callback, or with interrupts disabled
+static void reschedule (void)
+{
+	uint64_t now;
+	uint64_t next;
+	int i;
+
+	do {
+		now = time_us_64 ();
+		next = UINT64_MAX;
+		for (i = 0; i < NUM_SWITCHES; i++) {
+			run_slot (&slots [i], now);
+			if (slots [i].active && (slots [i].next < next)) next = slots [i].next;
+		}
+		if (next == UINT64_MAX) {
+			hardware_alarm_cancel (alarm_num);
+			return;
+		}
+	} while (hardware_alarm_set_target (alarm_num, from_us_since_boot (next)));		// true if target already passed
+}
+
+static void alarm_cb (uint alarm)
+{
+	(void) alarm;
+	reschedule ();
+}
+
+void repeat_init (void)
+{
+	alarm_num = hardware_alarm_claim_unused (true);
+	hardware_alarm_set_callback (alarm_num, alarm_cb);
+}
+
+// switch has been pressed: start repeat if it is on for this switch
+// packet holds the note-on of the switch, to be sent by the caller; it is changed to the first step of the arpeggio
+void repeat_press (int sw, const struct preset_table *table, uint8_t packet[4])
+{
+	struct repeat_slot *s = &slots [sw];
+	uint32_t period;
+	uint32_t ints;
+
+	if (table->repeat [sw].mode == REPEAT_OFF) return;
+
+	ints = save_and_disable_interrupts ();
+	memcpy (&s->cfg, &table->repeat [sw], sizeof (s->cfg));
+	memcpy (s->note_on, table->note_on [sw], sizeof (s->note_on));
+	if ((s->cfg.steps < 1) || (s->cfg.steps > REPEAT_MAX_STEPS)) s->cfg.steps = 1;
+	s->step = 0;
+	s->note = step_note (s);
+	packet [2] = s->note;
+	s->step_time = time_us_64 ();
+	check_clock (s->step_time);
+	period = period_of (s);
+
+	// first note is sent by the caller; if there is no room for its note-off, it is left sounding like a switch
+	// without repeat, and repeat starts at next step
+	s->sounding = reserve (true);
+	s->next = s->step_time + (s->sounding ? gate_of (s, period) : 0);
+
+	// following MIDI clock: next step is on the first step tick once the first note is off
+	if (clocked (s)) {
+		s->step_tick = align_tick (s, ticks);
+		while (tick_time (s->step_tick) < s->next + REPEAT_MIN_GATE_US) s->step_tick += s->cfg.clock_div;
+	}
+	if (!s->sounding) s->next = next_step (s, period);
+	s->active = true;
+	reschedule ();
+	restore_interrupts (ints);
+}
+
+// switch has been released: stop repeat, and send note-off if a note is sounding
+void repeat_release (int sw)
+{
+	struct repeat_slot *s = &slots [sw];
+	uint32_t ints;
+
+	ints = save_and_disable_interrupts ();
+	if (s->active) {
+		if (s->sounding) note_off (s);
+		s->active = false;
+		reschedule ();
+	}
+	restore_interrupts (ints);
+}
+
+bool repeat_active (int sw)
+{
+	return slots [sw].active;
+}
+
+// incoming MIDI clock: steps of slots following clock are due on every clock_div-th tick since MIDI start; they are
+// started by the alarm at the time predicted for their tick, so that they do not get the jitter of the main loop
+// reading ticks. Each tick received corrects the tick period, and the phase of the prediction.
+void repeat_clock (uint8_t status)
+{
+	struct repeat_slot *s;
+	uint64_t now = time_us_64 ();
+	uint64_t delta;
+	int64_t error;
+	bool acquired = false;
+	uint32_t ints;
+	int i;
+
+	if ((status != MIDI_START) && (status != MIDI_CLOCK)) return;
+
+	ints = save_and_disable_interrupts ();
+	if (status == MIDI_START) {
+		ticks = 0;				// next tick is the first one of the song, and starts a step
+		for (i = 0; i < NUM_SWITCHES; i++) slots [i].step_tick = 0;
+	}
+	else {
+		delta = now - last_tick;
+		if (tick_us) {
+			// an eighth of the error is corrected on each tick; prediction is reset if error is over a tick (tempo jump)
+			error = (int64_t) (now - clock_time) - tick_us;
+			if ((error > tick_us) || (error < -(int64_t) tick_us)) clock_time = now;
+			else clock_time += tick_us + error / 8;
+			if (delta < 1000000) tick_us = (tick_us * 15 + (uint32_t) delta) / 16;
+		}
+		else if (last_tick && (delta < 1000000)) {
+			// second tick after a pause: clock is back
+			tick_us = (uint32_t) delta;
+			clock_time = now;
+			acquired = true;
+		}
+		last_tick = now;
+		ticks++;
+	}
+
+	for (i = 0; i < NUM_SWITCHES; i++) {
+		s = &slots [i];
+		if (!s->active || !clocked (s)) continue;
+		// clock is back, or step tick went by long ago (alarm stalled): follow clock from next step tick
+		if (acquired || ((int32_t) (s->step_tick - (ticks - 1)) < 0)) s->step_tick = align_tick (s, ticks);
+		if (!s->sounding) s->next = tick_time (s->step_tick);
+	}
+	reschedule ();
+	restore_interrupts (ints);
+}
+
+// oldest event queued for USB, if any
+bool repeat_peek (uint8_t packet[4])
+{
+	if (ev_tail == ev_head) return false;
+	memcpy (packet, events [ev_tail % REPEAT_EVENTS], 4);
+	return true;
+}
+
+void repeat_pop (void)
+{
+	ev_tail++;
+}
@@ -0,0 +1,44 @@
+/*
+ * Note repeat / arpeggiator: while a switch is held, its note is retriggered at a fixed rate, or in sync with incoming
+ * MIDI clock; in arpeggiator mode, each step offsets the note by an interval (see struct repeat_config in config.h).
+ * When following MIDI clock, a step starts on every clock_div-th tick counted from MIDI start, so steps stay in phase
+ * with the clock. Steps are still started by the alarm, at the time predicted for their tick from the filtered tick
+ * period; ticks, read by the main loop, only correct the prediction. If ticks stop, steps go on at the fixed rate.
+ *
+ * Steps are scheduled from a single hardware alarm, not from the main loop, so their timing does not depend on loop
+ * period or stalls. The alarm callback walks the 8 switch slots once (bounded cost whatever the number of held
+ * switches), sends due events to DIN output at once, and queues them in a pre-allocated event ring for USB;
+ * midi_task() sends fresh presses first, then at most REPEAT_MAX_PER_LOOP queued events.
+ * Room for its note-off is reserved in both rings before a note is sent; when there is none, the step is skipped,
+ * so that a note-off is never dropped and no note is left stuck on the host or on DIN. Steps leave part of the DIN
+ * ring to fresh presses (see din_midi.h). Note-offs are sent as note-ons with velocity 0, for DIN running status.
+ * Skipped steps are counted, and returned by SysEx with DIN statistics (see sysex.h).
+ * Note and settings are copied when the switch is pressed, so a bank change does not alter a repeat in progress.
+ */
+
+#ifndef _REPEAT_H_
+#define _REPEAT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "preset.h"
+
+#define REPEAT_EVENTS			32			// size of event ring, must be a power of 2
+#define REPEAT_MAX_PER_LOOP		4			// max number of repeat events sent to USB per midi_task() call
+#define REPEAT_MIN_PERIOD_US	10000		// fastest repeat rate, 100 notes per second
+#define REPEAT_MIN_GATE_US		1000		// shortest note-on
+#define REPEAT_CLOCK_TIMEOUT	4			// MIDI clock is taken as stopped after this many tick periods without a tick
+
+extern uint32_t repeat_skipped;
+
+// function prototypes
+void repeat_init (void);
+void repeat_press (int, const struct preset_table *, uint8_t packet[4]);
+void repeat_release (int);
+bool repeat_active (int);
+void repeat_clock (uint8_t);
+bool repeat_peek (uint8_t packet[4]);
+void repeat_pop (void);
+
+#endif /* _REPEAT_H_ */
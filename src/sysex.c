@@ -0,0 +1,423 @@
+/*
+ * SysEx configuration of the pedal, see sysex.h for the message format
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "tusb.h"
+
+#include "config.h"
+#include "preset.h"
+#include "recorder.h"
+#include "usb_state.h"
+#include "boot.h"
+#include "din_midi.h"
+#include "repeat.h"
+#include "flash_writer.h"
+#include "sysex.h"
+#include "usb_descriptors.h"
+
+
+//--------------------------------------------------------------------+
+// Configuration commands
+//--------------------------------------------------------------------+
+
+#define SYSEX_MAX_ARGS	16		// max size of an argument tuple
+
+// decode a value sent as several 7-bit bytes, most significant first
+static uint32_t get_7bit (uint8_t const *args, int count)
+{
+	uint32_t value = 0;
+
+	while (count--) value = (value << 7) | *args++;
+	return value;
+}
+
+// encode a value as several 7-bit bytes, most significant first; return number of bytes
+int sysex_put_7bit (uint8_t *buf, uint64_t value, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) buf [i] = (value >> (7 * (count - 1 - i))) & 0x7F;
+	return count;
+}
+
+// send a short SysEx message: F0 7D <cmd> <data...> F7; data bytes must be 7-bit
+// reply is sent on the diagnostics cable; nothing is sent while the device is not mounted, nor during an export,
+// as the reply would be inserted in the middle of the export message
+void sysex_reply (uint8_t cmd, uint8_t const *data, int len)
+{
+	uint8_t msg [SYSEX_MAX_REPLY + 4];
+
+	if (!usb_tx_ready () || recorder_exporting () || (len > SYSEX_MAX_REPLY)) return;
+
+	msg [0] = SYSEX_START;
+	msg [1] = SYSEX_ID;
+	msg [2] = cmd;
+	memcpy (&msg [3], data, len);
+	msg [3 + len] = SYSEX_END;
+	tud_midi_stream_write (CABLE_DIAG, msg, len + 4);
+}
+
+static void set_note (uint8_t const *args)
+{
+	if (args [0] < NUM_SWITCHES) config.note [args [0]] = args [1];
+	preset_apply ();
+}
+
+static void set_channel (uint8_t const *args)
+{
+	config.channel = args [0] & 0x0F;
+	preset_apply ();
+}
+
+static void set_color (uint8_t const *args)
+{
+	uint8_t r = (uint8_t) get_7bit (&args [1], 2);
+	uint8_t g = (uint8_t) get_7bit (&args [3], 2);
+	uint8_t b = (uint8_t) get_7bit (&args [5], 2);
+
+	// GRB order, as in rgb_to_color()
+	if (args [0] < NUM_COLORS) config.color [args [0]] = ((uint32_t) g << 16) | ((uint32_t) r << 8) | b;
+	preset_apply ();
+}
+
+static void set_hold (uint8_t const *args)
+{
+	config.hold_us = get_7bit (args, 3) * 1000;
+	preset_apply ();
+}
+
+static void set_repeat (uint8_t const *args)
+{
+	struct repeat_config *rp;
+	int i;
+
+	if ((args [0] >= NUM_SWITCHES) || (args [1] > REPEAT_ARP)) return;
+
+	rp = &config.repeat [args [0]];
+	rp->mode = args [1];
+	rp->clock_div = args [2];
+	rp->gate = (args [3] > 100) ? 100 : args [3];
+	rp->period_us = get_7bit (&args [4], 3) * 1000;
+	rp->steps = ((args [7] < 1) || (args [7] > REPEAT_MAX_STEPS)) ? 1 : args [7];
+	for (i = 0; i < REPEAT_MAX_STEPS; i++) rp->interval [i] = (int8_t) (args [8 + i] - 64);	// 64 is no offset
+	preset_apply ();
+}
+
+static void select_bank (uint8_t const *args)
+{
+	preset_select (args [0]);
+}
+
+static void store_bank (uint8_t const *args)
+{
+	preset_store (args [0]);
+}
+
+static void rec_export (uint8_t const *args)
+{
+	recorder_export (args [0]);
+}
+
+static void rec_flush (uint8_t const *args)
+{
+	recorder_flush_enable (args [0] != 0);
+}
+
+static void get_rec_stats (uint8_t const *args)
+{
+	uint8_t data [15];
+	int n = 0;
+
+	(void) args;
+	n += sysex_put_7bit (&data [n], recorder_stats.realtime, 5);
+	n += sysex_put_7bit (&data [n], recorder_stats.sysex, 5);
+	n += sysex_put_7bit (&data [n], recorder_stats.lost, 5);
+	sysex_reply (SYSEX_REC_STATS, data, n);
+}
+
+static void get_usb_stats (uint8_t const *args)
+{
+	uint8_t data [25];
+	int n = 0;
+
+	(void) args;
+	n += sysex_put_7bit (&data [n], usb_stats.mount_us, 5);
+	n += sysex_put_7bit (&data [n], usb_stats.first_tx_us, 5);
+	n += sysex_put_7bit (&data [n], usb_stats.mounts, 5);
+	n += sysex_put_7bit (&data [n], usb_stats.replayed, 5);
+	n += sysex_put_7bit (&data [n], usb_stats.expired, 5);
+	sysex_reply (SYSEX_USB_STATS, data, n);
+}
+
+static void get_boot_times (uint8_t const *args)
+{
+	uint8_t data [5 * BOOT_PHASES];
+	int n = 0;
+	int i;
+
+	(void) args;
+	for (i = 0; i < BOOT_PHASES; i++) n += sysex_put_7bit (&data [n], boot_time [i], 5);
+	sysex_reply (SYSEX_BOOT_TIMES, data, n);
+}
+
+static void set_din_thru (uint8_t const *args)
+{
+	din_thru = (args [0] != 0);
+}
+
+static void get_din_stats (uint8_t const *args)
+{
+	uint8_t data [35];
+	uint32_t timed = din_stats.messages - din_stats.flash_delayed;
+	int n = 0;
+
+	(void) args;
+	n += sysex_put_7bit (&data [n], din_stats.messages, 5);
+	n += sysex_put_7bit (&data [n], din_stats.dropped, 5);
+	n += sysex_put_7bit (&data [n], din_stats.max_latency_us, 5);
+	n += sysex_put_7bit (&data [n], timed ? (uint32_t) (din_stats.sum_latency_us / timed) : 0, 5);
+	n += sysex_put_7bit (&data [n], din_stats.flash_delayed, 5);
+	n += sysex_put_7bit (&data [n], din_stats.flash_max_latency_us, 5);
+	n += sysex_put_7bit (&data [n], repeat_skipped, 5);
+	sysex_reply (SYSEX_DIN_STATS, data, n);
+}
+
+// ping: reply with receive time (when USB transfer holding the ping was received) and transmit time
+static void ping (uint8_t const *args)
+{
+	uint8_t data [22];
+	int n = 0;
+
+	data [n++] = args [0];
+	data [n++] = args [1];
+	n += sysex_put_7bit (&data [n], usb_rx_time, 10);
+	n += sysex_put_7bit (&data [n], time_us_64 (), 10);
+	sysex_reply (SYSEX_PING, data, n);
+}
+
+static void set_replay_age (uint8_t const *args)
+{
+	replay_age_us = get_7bit (args, 3) * 1000;
+}
+
+// table of configuration commands: command, size of argument tuple, function applying the tuple
+static const struct {
+	uint8_t cmd;
+	uint8_t nargs;
+	void (*apply) (uint8_t const *);
+} commands [] = {
+	{ SYSEX_SET_NOTE,		2, set_note },
+	{ SYSEX_SET_CHANNEL,	1, set_channel },
+	{ SYSEX_SET_COLOR,		7, set_color },
+	{ SYSEX_SET_HOLD,		3, set_hold },
+	{ SYSEX_SET_REPEAT,		12, set_repeat },
+	{ SYSEX_SELECT_BANK,	1, select_bank },
+	{ SYSEX_STORE_BANK,		1, store_bank },
+	{ SYSEX_EXPORT,			1, rec_export },
+	{ SYSEX_REC_FLUSH,		1, rec_flush },
+	{ SYSEX_REC_STATS,		0, get_rec_stats },
+	{ SYSEX_USB_STATS,		0, get_usb_stats },
+	{ SYSEX_REPLAY_AGE,		3, set_replay_age },
+	{ SYSEX_BOOT_TIMES,		0, get_boot_times },
+	{ SYSEX_DIN_THRU,		1, set_din_thru },
+	{ SYSEX_DIN_STATS,		0, get_din_stats },
+	{ SYSEX_PING,			2, ping },
+};
+
+
+//--------------------------------------------------------------------+
+// Dump to flash
+//--------------------------------------------------------------------+
+
+// data is queued to the flash writer page by page (see flash_writer.h)
+static uint8_t page [FLASH_PAGE_SIZE];
+static uint32_t page_fill = 0;				// number of bytes in page being filled
+static bool page_full = false;				// page is full and waiting for room in the flash writer queue
+static uint32_t dump_offset;				// flash offset of page being filled
+static bool dump_reload = false;			// reload preset banks once all pages are written
+
+static void dump_start (uint8_t sector)
+{
+	page_fill = 0;
+	dump_offset = CONFIG_FLASH_OFFSET + (uint32_t) sector * FLASH_SECTOR_SIZE;
+}
+
+// queue page being filled; sector is erased before its first page is written
+static void dump_page_queue (void)
+{
+	page_full = !flash_writer_queue (dump_offset, page, (dump_offset % FLASH_SECTOR_SIZE) == 0);
+	if (page_full) return;
+
+	page_fill = 0;
+	dump_offset += FLASH_PAGE_SIZE;
+}
+
+static void dump_byte (uint8_t data)
+{
+	// drop data that does not fit in configuration region
+	if (dump_offset >= CONFIG_FLASH_OFFSET + CONFIG_FLASH_SIZE) return;
+
+	page [page_fill++] = data;
+	if (page_fill == FLASH_PAGE_SIZE) dump_page_queue ();
+}
+
+static void dump_end (void)
+{
+	// pad last page with erased flash value
+	if (page_fill) {
+		memset (&page [page_fill], 0xFF, FLASH_PAGE_SIZE - page_fill);
+		page_fill = FLASH_PAGE_SIZE;
+		dump_page_queue ();
+	}
+	dump_reload = true;
+}
+
+// incoming data may only be accepted if a whole USB-MIDI packet (3 bytes) can be stored without
+// overwriting a page which has not been queued yet; otherwise packets are left in the USB FIFO
+bool sysex_ready (void)
+{
+	return !page_full && (flash_writer_room () || (page_fill + 3 < FLASH_PAGE_SIZE));
+}
+
+// queue full page once there is room in the flash writer; called from the main loop
+void sysex_task (void)
+{
+	if (page_full) {
+		dump_page_queue ();
+		return;
+	}
+
+	// all pages written: dump is complete
+	if (dump_reload && flash_writer_idle ()) {
+		dump_reload = false;
+		preset_reload ();
+	}
+}
+
+
+//--------------------------------------------------------------------+
+// SysEx parser
+//--------------------------------------------------------------------+
+
+enum {
+	SX_IDLE,		// not in a SysEx message, or message is not for us
+	SX_ID,			// waiting for manufacturer ID
+	SX_CMD,			// waiting for command
+	SX_ARGS,		// receiving argument tuples of a configuration command
+	SX_SECTOR,		// waiting for first sector of dump
+	SX_DUMP,		// receiving dump data
+};
+
+static int state = SX_IDLE;
+static int cmd_idx;							// index of current command in commands[]
+static uint8_t args [SYSEX_MAX_ARGS];		// argument tuple being received
+static uint8_t nargs;						// number of bytes received in tuple
+static uint8_t msbs;						// 7-in-8 decoding: bit 7 of the data bytes of current group
+static uint8_t group_pos;					// 7-in-8 decoding: position in group, 0 to 7
+
+static void parse_end (void)
+{
+	if ((state == SX_SECTOR) || (state == SX_DUMP)) dump_end ();
+	state = SX_IDLE;
+}
+
+static void parse_byte (uint8_t b)
+{
+	uint32_t i;
+
+	// status bytes
+	if (b == SYSEX_START) {
+		parse_end ();		// previous message not terminated
+		state = SX_ID;
+		return;
+	}
+	if (b & 0x80) {
+		parse_end ();		// SYSEX_END, or any status byte terminating the message
+		return;
+	}
+
+	// data bytes
+	switch (state) {
+		case SX_ID:
+			state = (b == SYSEX_ID) ? SX_CMD : SX_IDLE;
+			break;
+
+		case SX_CMD:
+			if (b == SYSEX_DUMP) {
+				state = SX_SECTOR;
+				break;
+			}
+			state = SX_IDLE;
+			for (i = 0; i < sizeof (commands) / sizeof (commands [0]); i++) {
+				if (commands [i].cmd == b) {
+					cmd_idx = i;
+					nargs = 0;
+					state = SX_ARGS;
+					// commands without arguments are applied at once
+					if (commands [i].nargs == 0) {
+						commands [i].apply (args);
+						state = SX_IDLE;
+					}
+					break;
+				}
+			}
+			break;
+
+		case SX_ARGS:
+			args [nargs++] = b;
+			// apply tuple as soon as it is complete
+			if (nargs == commands [cmd_idx].nargs) {
+				commands [cmd_idx].apply (args);
+				nargs = 0;
+			}
+			break;
+
+		case SX_SECTOR:
+			if (b >= CONFIG_FLASH_SIZE / FLASH_SECTOR_SIZE) {
+				state = SX_IDLE;
+				break;
+			}
+			dump_start (b);
+			group_pos = 0;
+			state = SX_DUMP;
+			break;
+
+		case SX_DUMP:
+			if (group_pos == 0) msbs = b;
+			else dump_byte (b | (((msbs >> (group_pos - 1)) & 1) << 7));
+			group_pos = (group_pos + 1) & 7;
+			break;
+
+		default:
+			break;
+	}
+}
+
+// parse an incoming USB-MIDI packet; return true if packet was a SysEx packet
+bool sysex_parse_packet (uint8_t const packet[4])
+{
+	int len;
+	int i;
+
+	// byte 0 = cable number | Code Index Number (CIN)
+	switch (packet [0] & 0x0F) {
+		case 0x4:			// SysEx starts or continues, 3 bytes
+		case 0x7:			// SysEx ends with 3 bytes
+			len = 3;
+			break;
+		case 0x6:			// SysEx ends with 2 bytes
+			len = 2;
+			break;
+		case 0x5:			// SysEx ends with 1 byte, or single-byte system common message
+			len = 1;
+			break;
+		default:
+			return false;
+	}
+
+	for (i = 0; i < len; i++) parse_byte (packet [1 + i]);
+	return true;
+}
@@ -0,0 +1,106 @@
+/*
+ * SysEx configuration of the pedal.
+ *
+ * Messages are parsed on the fly, as USB-MIDI packets (CIN 0x4 to 0x7) arrive: no message is assembled in RAM,
+ * so there is no limit on message length. Each configuration field is applied as soon as its last byte is received.
+ *
+ * Message format:  F0 7D <command> <arguments...> F7			(7D is the manufacturer ID for non-commercial use)
+ * Commands are only accepted on the diagnostics cable, and replies are sent on it (see usb_descriptors.h).
+ *
+ * Configuration commands take fixed-size argument tuples; several tuples may follow each other in the same message
+ * (eg. F0 7D 01 00 24 01 26 F7 sets note 36 on switch 1 and note 38 on switch 2).
+ * Configuration commands edit the configuration of the active bank; edits are lost on bank change unless stored.
+ *   01 SET_NOTE     sw note					sw: 0 to 7 (switch 1 to 8), note: 0 to 127
+ *   02 SET_CHANNEL  ch							ch: 0 to 15
+ *   03 SET_COLOR    slot rh rl gh gl bh bl		slot: 0 (velocity 127) or 1 (other velocities); each color component
+ *												is sent as 2 bytes: bit 7, then bits 6-0
+ *   04 SET_HOLD     ms2 ms1 ms0				neopixel hold time in ms, 21 bits, most significant 7 bits first
+ *   05 SELECT_BANK  bank						bank: 0 to NUM_BANKS-1 (see preset.h); same as a program change
+ *   06 STORE_BANK   bank						store configuration being edited into bank (RAM and flash)
+ *   07 SET_REPEAT   sw mode div gate ms2 ms1 ms0 steps i0 i1 i2 i3
+ *												note repeat of switch sw (see repeat.h); mode: 0 (off), 1 (repeat) or
+ *												2 (arpeggiator); div: MIDI clock ticks per step, 0 for a fixed period
+ *												of ms ms; gate: note-on length in % of period; steps: 1 to 4;
+ *												i0-i3: interval of each arpeggiator step, in semitones + 64
+ *
+ * Dump command: raw data is written to the configuration flash region (see config.h) while it is received.
+ *   10 DUMP         sector <data...>			sector: first sector of the region to write to (4KB sectors);
+ *												bank b is stored in sector b, as a struct pedal_config
+ *												data: 8-bit data packed in groups of 8 bytes; first byte of a group
+ *												holds bit 7 of the 7 following bytes (bit 0 for the 1st byte, etc.)
+ * Data is queued page by page to the flash writer (see flash_writer.h); once all pages are written, preset banks are
+ * reloaded from flash.
+ *
+ * Recorder commands (see recorder.h):
+ *   20 EXPORT       src						stream event log out as a Standard MIDI File; src: 0 (RAM) or 1 (flash)
+ *												reply: F0 7D 20 <SMF data, packed as for DUMP> F7
+ *												requests needing a reply are ignored until the export is complete
+ *   21 REC_FLUSH    on							on: 1 to flush event log to flash in the background, 0 to stop
+ *   22 REC_STATS								reply: F0 7D 22 <clock and active sensing messages> <diagnostics SysEx
+ *												messages> <lost records> F7; the first 2 are counted instead of being
+ *												logged; records are lost when the ring is full during an export;
+ *												values are sent as 5 bytes (35 bits), most significant 7 bits first
+ *
+ * USB commands (see usb_state.h); values in replies are sent as 5 bytes (35 bits), most significant 7 bits first:
+ *   30 USB_STATS								reply: F0 7D 30 <power-on to mount us> <mount to first note us>
+ *												<mounts> <replayed events> <expired events> F7
+ *   31 REPLAY_AGE   ms2 ms1 ms0				switch events older than this are not replayed once mounted
+ *   32 BOOT_TIMES								reply: F0 7D 32 <time of each boot phase in us, see boot.h> F7
+ *
+ * DIN MIDI commands (see din_midi.h):
+ *   40 DIN_THRU     on							on: 1 to merge USB-received messages into DIN output, 0 to stop
+ *   41 DIN_STATS								reply: F0 7D 41 <messages> <dropped> <max latency us> <average latency us>
+ *												<flash delayed> <their max latency us> <skipped repeat steps> F7;
+ *												messages queued before a flash operation are only counted in
+ *												flash delayed and their max latency; repeat steps are skipped when
+ *												DIN or USB output is too busy (see repeat.h)
+ *
+ * Latency probe (see tools/latency_probe.c):
+ *   50 PING         seq1 seq0					reply: F0 7D 50 seq1 seq0 <rx time> <tx time> F7; times are time_us_64()
+ *												as 10 bytes (70 bits), most significant 7 bits first. rx time is when
+ *												midi_task() read the last packet of the ping from the USB FIFO, tx
+ *												time is when the reply is queued for sending. Time spent in the FIFO
+ *												(main loop period, or packets held back while a dump is written) is
+ *												not measured, and adds to the host-to-device delay
+ */
+
+#ifndef _SYSEX_H_
+#define _SYSEX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// SysEx constants
+#define SYSEX_START			0xF0
+#define SYSEX_END			0xF7
+#define SYSEX_ID			0x7D		// manufacturer ID for non-commercial use
+
+// SysEx commands
+#define SYSEX_SET_NOTE		0x01
+#define SYSEX_SET_CHANNEL	0x02
+#define SYSEX_SET_COLOR		0x03
+#define SYSEX_SET_HOLD		0x04
+#define SYSEX_SELECT_BANK	0x05
+#define SYSEX_STORE_BANK	0x06
+#define SYSEX_SET_REPEAT	0x07
+#define SYSEX_DUMP			0x10
+#define SYSEX_EXPORT		0x20
+#define SYSEX_REC_FLUSH		0x21
+#define SYSEX_REC_STATS		0x22
+#define SYSEX_USB_STATS		0x30
+#define SYSEX_REPLAY_AGE	0x31
+#define SYSEX_BOOT_TIMES	0x32
+#define SYSEX_DIN_THRU		0x40
+#define SYSEX_DIN_STATS		0x41
+#define SYSEX_PING			0x50
+
+#define SYSEX_MAX_REPLY		40		// max number of data bytes in a reply
+
+// function prototypes
+bool sysex_ready (void);
+bool sysex_parse_packet (uint8_t const packet[4]);
+void sysex_task (void);
+int sysex_put_7bit (uint8_t *, uint64_t, int);
+void sysex_reply (uint8_t, uint8_t const *, int);
+
+#endif /* _SYSEX_H_ */
@@ -26,6 +26,8 @@
 #include "bsp/board_api.h"
 #include "tusb.h"
 
+#include "usb_descriptors.h"
+
 /* A combination of interfaces must have a unique product id, since PC will save device driver after the first plug.
  * Same VID/PID with different interface e.g MSC (first), then CDC (later) will possibly cause system error on PC.
  *
@@ -68,6 +70,15 @@ uint8_t const * tud_descriptor_device_cb(void)
 }
 
 
+//--------------------------------------------------------------------+
+// Routing tables
+//--------------------------------------------------------------------+
+
+const uint8_t usb_switch_cable[NUM_SWITCHES] = USB_SWITCH_CABLES;
+
+#define CABLE_RX(id, name, rx)  [id] = rx,
+const uint8_t usb_cable_rx[16] = { USB_CABLES(CABLE_RX) };
+
 //--------------------------------------------------------------------+
 // Configuration Descriptor
 //--------------------------------------------------------------------+
@@ -79,7 +90,18 @@ enum
   ITF_NUM_TOTAL
 };
 
-#define CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_MIDI_DESC_LEN)
+// String Descriptor Index: one jack string per cable, after the device strings
+enum {
+  STRID_LANGID = 0,
+  STRID_MANUFACTURER,
+  STRID_PRODUCT,
+  STRID_SERIAL,
+  STRID_CABLE,
+  STRID_TOTAL = STRID_CABLE + NUM_CABLES
+};
+
+#define TUD_MIDI_CABLES_DESC_LEN  (TUD_MIDI_DESC_HEAD_LEN + NUM_CABLES * TUD_MIDI_DESC_JACK_LEN + 2 * TUD_MIDI_DESC_EP_LEN(NUM_CABLES))
+#define CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_MIDI_CABLES_DESC_LEN)
 
 #if CFG_TUSB_MCU == OPT_MCU_LPC175X_6X || CFG_TUSB_MCU == OPT_MCU_LPC177X_8X || CFG_TUSB_MCU == OPT_MCU_LPC40XX
   // LPC 17xx and 40xx endpoint type (bulk/interrupt/iso) are fixed by its number
@@ -95,26 +117,36 @@ enum
   #define EPNUM_MIDI_IN   0x01
 #endif
 
+// tinyusb jack macros number cables from 1
+#define CABLE_JACKS(id, name, rx)    TUD_MIDI_DESC_JACK_DESC((id) + 1, STRID_CABLE + (id)),
+#define CABLE_JACK_IN(id, name, rx)  TUD_MIDI_JACKID_IN_EMB((id) + 1),
+#define CABLE_JACK_OUT(id, name, rx) TUD_MIDI_JACKID_OUT_EMB((id) + 1),
+
+// MIDI function with all cables of the spec; OUT endpoint feeds the embedded IN jacks, embedded OUT jacks feed IN endpoint
+#define CONFIG_DESCRIPTOR(_epsize) \
+  /* Config number, interface count, string index, total length, attribute, power in mA */\
+  TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0x00, 100),\
+  TUD_MIDI_DESC_HEAD(ITF_NUM_MIDI, 0, NUM_CABLES),\
+  USB_CABLES(CABLE_JACKS)\
+  TUD_MIDI_DESC_EP(EPNUM_MIDI_OUT, _epsize, NUM_CABLES),\
+  USB_CABLES(CABLE_JACK_IN)\
+  TUD_MIDI_DESC_EP((0x80 | EPNUM_MIDI_IN), _epsize, NUM_CABLES),\
+  USB_CABLES(CABLE_JACK_OUT)
+
 uint8_t const desc_fs_configuration[] =
 {
-  // Config number, interface count, string index, total length, attribute, power in mA
-  TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0x00, 100),
-
-  // Interface number, string index, EP Out & EP In address, EP size
-  TUD_MIDI_DESCRIPTOR(ITF_NUM_MIDI, 0, EPNUM_MIDI_OUT, (0x80 | EPNUM_MIDI_IN), 64)
+  CONFIG_DESCRIPTOR(USB_MIDI_EP_SIZE_FS)
 };
 
 #if TUD_OPT_HIGH_SPEED
 uint8_t const desc_hs_configuration[] =
 {
-  // Config number, interface count, string index, total length, attribute, power in mA
-  TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0x00, 100),
-
-  // Interface number, string index, EP Out & EP In address, EP size
-  TUD_MIDI_DESCRIPTOR(ITF_NUM_MIDI, 0, EPNUM_MIDI_OUT, (0x80 | EPNUM_MIDI_IN), 512)
+  CONFIG_DESCRIPTOR(USB_MIDI_EP_SIZE_HS)
 };
 #endif
 
+TU_VERIFY_STATIC(sizeof(desc_fs_configuration) == CONFIG_TOTAL_LEN, "configuration descriptor length");
+
 // Invoked when received GET CONFIGURATION DESCRIPTOR
 // Application return pointer to descriptor
 // Descriptor contents must exist long enough for transfer to complete
@@ -134,63 +166,50 @@ uint8_t const * tud_descriptor_configuration_cb(uint8_t index)
 // String Descriptors
 //--------------------------------------------------------------------+
 
-// String Descriptor Index
-enum {
-  STRID_LANGID = 0,
-  STRID_MANUFACTURER,
-  STRID_PRODUCT,
-  STRID_SERIAL,
-};
+// ready-made string descriptor from a string literal: header (type, length in bytes), then UTF-16 characters
+// u"" s makes a UTF-16 literal; the array keeps its terminating 0, which is not sent: the descriptor length is the
+// size of the literal less 2 bytes for the 0, plus 2 bytes for the header
+#define STRING_DESC(_name, _str) \
+  static const struct { uint16_t header; uint16_t str[sizeof(u"" _str) / 2]; } _name = \
+    { (uint16_t) ((TUSB_DESC_STRING << 8) | sizeof(u"" _str)), u"" _str }
+
+static const struct { uint16_t header; uint16_t langid; } desc_langid =
+  { (uint16_t) ((TUSB_DESC_STRING << 8) | 4), 0x0409 };   // supported language is English (0x0409)
+
+STRING_DESC(desc_manufacturer, USB_MANUFACTURER);
+STRING_DESC(desc_product, USB_PRODUCT);
+
+#define CABLE_STRING(id, name, rx)  STRING_DESC(desc_##id, name);
+USB_CABLES(CABLE_STRING)
 
-// array of pointer to string descriptors
-char const *string_desc_arr[] =
+// serial is made from the unique ID of the flash chip, once, on first request
+static uint16_t desc_serial[32 + 1];
+
+#define CABLE_STRING_PTR(id, name, rx)  [STRID_CABLE + (id)] = &desc_##id.header,
+static uint16_t const * const string_desc[STRID_TOTAL] =
 {
-  (const char[]) { 0x09, 0x04 }, // 0: is supported language is English (0x0409)
-  "TinyUSB",                     // 1: Manufacturer
-  "TinyUSB Device",              // 2: Product
-  NULL,                          // 3: Serials will use unique ID if possible
+  [STRID_LANGID]       = &desc_langid.header,
+  [STRID_MANUFACTURER] = &desc_manufacturer.header,
+  [STRID_PRODUCT]      = &desc_product.header,
+  [STRID_SERIAL]       = desc_serial,
+  USB_CABLES(CABLE_STRING_PTR)
 };
 
-static uint16_t _desc_str[32 + 1];
-
 // Invoked when received GET STRING DESCRIPTOR request
 // Application return pointer to descriptor, whose contents must exist long enough for transfer to complete
 uint16_t const *tud_descriptor_string_cb(uint8_t index, uint16_t langid) {
   (void) langid;
   size_t chr_count;
 
-  switch ( index ) {
-    case STRID_LANGID:
-      memcpy(&_desc_str[1], string_desc_arr[0], 2);
-      chr_count = 1;
-      break;
-
-    case STRID_SERIAL:
-      chr_count = board_usb_get_serial(_desc_str + 1, 32);
-      break;
-
-    default:
-      // Note: the 0xEE index string is a Microsoft OS 1.0 Descriptors.
-      // https://docs.microsoft.com/en-us/windows-hardware/drivers/usbcon/microsoft-defined-usb-descriptors
+  // Note: the 0xEE index string is a Microsoft OS 1.0 Descriptors.
+  // https://docs.microsoft.com/en-us/windows-hardware/drivers/usbcon/microsoft-defined-usb-descriptors
+  if ( !(index < STRID_TOTAL) ) return NULL;
 
-      if ( !(index < sizeof(string_desc_arr) / sizeof(string_desc_arr[0])) ) return NULL;
-
-      const char *str = string_desc_arr[index];
-
-      // Cap at max char
-      chr_count = strlen(str);
-      size_t const max_count = sizeof(_desc_str) / sizeof(_desc_str[0]) - 1; // -1 for string type
-      if ( chr_count > max_count ) chr_count = max_count;
-
-      // Convert ASCII string into UTF-16
-      for ( size_t i = 0; i < chr_count; i++ ) {
-        _desc_str[1 + i] = str[i];
-      }
-      break;
+  if ( (index == STRID_SERIAL) && (desc_serial[0] == 0) ) {
+    chr_count = board_usb_get_serial(desc_serial + 1, 32);
+    // first byte is length (including header), second byte is string type
+    desc_serial[0] = (uint16_t) ((TUSB_DESC_STRING << 8) | (2 * chr_count + 2));
   }
 
-  // first byte is length (including header), second byte is string type
-  _desc_str[0] = (uint16_t) ((TUSB_DESC_STRING << 8) | (2 * chr_count + 2));
-
-  return _desc_str;
+  return string_desc[index];
 }
@@ -0,0 +1,53 @@
+/*
+ * USB device spec: strings and virtual MIDI cables of the pedal.
+ *
+ * Descriptors are generated at compile time from the lists below (see usb_descriptors.c): the configuration descriptor
+ * holds one pair of embedded jacks per cable, and string descriptors are stored as ready-made UTF-16 arrays, so that
+ * enumeration does no conversion. Each cable is a separate MIDI port on the host (eg. ALSA subdevice hw:x,0,<cable>).
+ *
+ * Cable list:  X(id, name, rx)		id: cable number in USB-MIDI packets, in list order
+ *									name: jack string, shown as port name by the host
+ *									rx: what is done with packets received on this cable
+ * Switches 1 to 5 (pedal) send on the pedal cable, 6 to 8 (finger switches) on the finger cable; SysEx replies and
+ * event log export are sent on the diagnostics cable, which is the only one accepting SysEx commands (see sysex.h).
+ */
+
+#ifndef _USB_DESCRIPTORS_H_
+#define _USB_DESCRIPTORS_H_
+
+#include <stdint.h>
+
+#include "config.h"
+
+// device strings
+#define USB_MANUFACTURER		"TinyUSB"
+#define USB_PRODUCT				"TinyUSB Device"
+
+// endpoint size, full speed and high speed (max size of bulk endpoints)
+#define USB_MIDI_EP_SIZE_FS		64
+#define USB_MIDI_EP_SIZE_HS		512
+
+// what is done with packets received on a cable
+#define USB_RX_PLAY				1		// program change, MIDI clock, DIN thru, neopixel
+#define USB_RX_SYSEX			2		// SysEx commands
+
+#define USB_CABLES(X) \
+	X (CABLE_PEDAL,		"Pedal",		USB_RX_PLAY) \
+	X (CABLE_FINGER,	"Finger",		USB_RX_PLAY) \
+	X (CABLE_DIAG,		"Diagnostics",	USB_RX_SYSEX)
+
+#define USB_CABLE_ENUM(id, name, rx)	id,
+enum {
+	USB_CABLES (USB_CABLE_ENUM)
+	NUM_CABLES
+};
+
+// cable of each switch
+#define USB_SWITCH_CABLES		{ CABLE_PEDAL, CABLE_PEDAL, CABLE_PEDAL, CABLE_PEDAL, CABLE_PEDAL, \
+								  CABLE_FINGER, CABLE_FINGER, CABLE_FINGER }
+
+// routing tables
+extern const uint8_t usb_switch_cable [NUM_SWITCHES];
+extern const uint8_t usb_cable_rx [16];		// indexed by cable number of a received packet; 0 for unknown cables
+
+#endif /* _USB_DESCRIPTORS_H_ */
@@ -0,0 +1,102 @@
+/*
+ * USB device state and replay of switch events, see usb_state.h
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "tusb.h"
+
+#include "recorder.h"
+#include "usb_state.h"
+
+
+// type definition
+struct replay_event {
+	uint64_t time;					// time switch event happened
+	uint8_t packet [4];
+};
+
+volatile int usb_state = USB_UNMOUNTED;
+volatile uint64_t usb_rx_time = 0;			// time packet being processed was read from the USB FIFO, set by midi_task()
+uint32_t replay_age_us = REPLAY_AGE_US;
+struct usb_stats usb_stats;
+
+static struct replay_event queue [REPLAY_QUEUE_SIZE];
+static uint32_t queue_head = 0;			// free-running, wrapped on access
+static uint32_t queue_tail = 0;
+static uint64_t mount_time = 0;
+static bool mounted = false;			// set by mount callback, cleared by unmount callback only: not changed by suspend
+static bool first_tx = false;			// waiting for first note after mount
+
+
+// called from tinyusb callbacks
+void usb_state_set (int state)
+{
+	usb_state = state;
+}
+
+// called from mount and unmount callbacks only; a mount is timed whatever the state before it, as the bus may be
+// suspended between reset and configuration
+void usb_mount (bool mount)
+{
+	if (mount && !mounted) {
+		mount_time = time_us_64 ();
+		usb_stats.mount_us = (uint32_t) mount_time;
+		usb_stats.first_tx_us = 0;
+		usb_stats.mounts++;
+		first_tx = true;
+	}
+	mounted = mount;
+	usb_state_set (mount ? USB_MOUNTED : USB_UNMOUNTED);
+}
+
+// packets may only be sent when host has configured the device
+bool usb_tx_ready (void)
+{
+	return usb_state == USB_MOUNTED;
+}
+
+// a note has been sent: press, replayed press or repeat event; SysEx replies do not count
+void usb_tx_done (void)
+{
+	if (first_tx) {
+		usb_stats.first_tx_us = (uint32_t) (time_us_64 () - mount_time);
+		first_tx = false;
+	}
+}
+
+// keep a switch event which could not be sent; oldest event is dropped if queue is full
+void replay_push (uint8_t const packet[4])
+{
+	if (queue_head - queue_tail == REPLAY_QUEUE_SIZE) {
+		queue_tail++;
+		usb_stats.expired++;
+	}
+	queue [queue_head % REPLAY_QUEUE_SIZE].time = time_us_64 ();
+	memcpy (queue [queue_head % REPLAY_QUEUE_SIZE].packet, packet, 4);
+	queue_head++;
+}
+
+// once mounted, send events still young enough, in the order they happened
+void replay_task (void)
+{
+	struct replay_event *ev;
+	uint64_t now;
+
+	if (!usb_tx_ready ()) return;
+
+	now = time_us_64 ();
+	while (queue_tail != queue_head) {
+		ev = &queue [queue_tail % REPLAY_QUEUE_SIZE];
+		if (now - ev->time > replay_age_us) {
+			usb_stats.expired++;
+		}
+		else {
+			if (!tud_midi_packet_write (ev->packet)) return;	// FIFO full: retry on next call
+			recorder_log (REC_TX, ev->packet);
+			usb_tx_done ();
+			usb_stats.replayed++;
+		}
+		queue_tail++;
+	}
+}
@@ -0,0 +1,49 @@
+/*
+ * USB device state, as reported by tinyusb callbacks (see main.c), and replay of switch presses made while the
+ * device is not mounted (during boot, enumeration or after a hub re-plug).
+ *
+ * Nothing is sent while the device is not mounted. Switch events are kept in a small queue instead; once mounted,
+ * only events younger than the replay age are sent, older ones are dropped as they would come too late to be useful.
+ * Presses of switches in note repeat mode are not kept, as their note-off would not be replayed (see repeat.h).
+ * Time from power-on to mount and from mount to first note sent are measured, and returned by SysEx (see sysex.h).
+ */
+
+#ifndef _USB_STATE_H_
+#define _USB_STATE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define REPLAY_QUEUE_SIZE	8			// max number of switch events kept while not mounted; oldest are dropped
+#define REPLAY_AGE_US		200000		// default replay age: events older than 200ms are not replayed
+
+// USB states
+enum {
+	USB_UNMOUNTED,
+	USB_MOUNTED,
+	USB_SUSPENDED,
+};
+
+// type definition
+struct usb_stats {
+	uint32_t mount_us;				// time from power-on to last mount, in us
+	uint32_t first_tx_us;			// time from last mount to first note sent, in us; 0 if none sent yet
+	uint32_t mounts;				// number of mounts since power-on
+	uint32_t replayed;				// number of events replayed
+	uint32_t expired;				// number of events dropped because too old, or queue full
+};
+
+extern volatile int usb_state;
+extern volatile uint64_t usb_rx_time;
+extern uint32_t replay_age_us;
+extern struct usb_stats usb_stats;
+
+// function prototypes
+void usb_state_set (int);
+void usb_mount (bool);
+bool usb_tx_ready (void);
+void usb_tx_done (void);
+void replay_push (uint8_t const packet[4]);
+void replay_task (void);
+
+#endif /* _USB_STATE_H_ */
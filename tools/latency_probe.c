@@ -0,0 +1,335 @@
+/*
+ * Host round-trip latency probe and clock offset estimator for the MIDI pedal (Linux, ALSA rawmidi).
+ *
+ * Sends bursts of SysEx pings (F0 7D 50 seq1 seq0 F7) to the pedal, which answers with its receive and transmit times
+ * (see src/sysex.h). For each ping, with t1/t4 host send/receive times and t2/t3 device receive/transmit times:
+ *   delay  = (t4 - t1) - (t3 - t2)				round-trip time spent in the host stack and on the wire
+ *   offset = ((t2 - t1) + (t3 - t4)) / 2		device clock minus host clock
+ * As in NTP, the offset of a ping is only trusted when its delay is small: the lowest-delay ping of each burst is kept,
+ * and a least-squares fit of these offsets over time gives the device-to-host clock offset and drift.
+ * t2 is taken when the pedal main loop reads the ping from its USB FIFO, not when the USB transfer arrives: time the
+ * ping waits in the FIFO counts as host-to-device delay, and biases its offset by half of it. Keeping the lowest-delay
+ * ping filters this out as long as the pedal is otherwise idle (no dump in progress).
+ *
+ * Respond mode (-r) answers pings like the pedal does, with a synthetic clock offset and drift; run it on one end of a
+ * virtual MIDI port (eg. snd-virmidi, connected with aconnect to another virmidi port) to try the probe without a pedal.
+ *
+ * build: gcc -O2 -Wall -o latency_probe tools/latency_probe.c -lasound -lm
+ * usage: latency_probe [-b bursts] [-n pings] [-i ping_ms] [-I burst_ms] <port>		eg. latency_probe hw:1,0,2
+ *        latency_probe -r [-o offset_us] [-d drift_ppm] <port>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <alsa/asoundlib.h>
+
+
+// SysEx constants, as in src/sysex.h
+#define SYSEX_START		0xF0
+#define SYSEX_END		0xF7
+#define SYSEX_ID		0x7D
+#define SYSEX_PING		0x50
+
+#define PONG_LEN		(3 + 2 + 10 + 10 + 1)	// F0 7D 50 seq1 seq0 rx(10) tx(10) F7
+#define PONG_TIMEOUT_US	100000					// pings not answered within 100ms are lost
+#define MAX_SYSEX		64
+
+// type definition
+struct sample {
+	uint64_t t1, t2, t3, t4;		// host send, device receive, device transmit, host receive; in us
+	int64_t delay;
+	double offset;
+	int burst;
+};
+
+struct sysex_in {
+	uint8_t buf [MAX_SYSEX];
+	int len;
+	bool in_sysex;
+};
+
+static snd_rawmidi_t *midi_in = NULL;
+static snd_rawmidi_t *midi_out = NULL;
+
+
+static uint64_t now_us (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_us (uint64_t us)
+{
+	struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+	nanosleep (&ts, NULL);
+}
+
+// decode a value sent as several 7-bit bytes, most significant first
+static uint64_t get_7bit (uint8_t const *buf, int count)
+{
+	uint64_t value = 0;
+
+	while (count--) value = (value << 7) | *buf++;
+	return value;
+}
+
+static void put_7bit (uint8_t *buf, uint64_t value, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) buf [i] = (value >> (7 * (count - 1 - i))) & 0x7F;
+}
+
+// feed a received byte; return true when a complete SysEx message is in buffer
+static bool sysex_feed (struct sysex_in *sx, uint8_t b)
+{
+	if (b == SYSEX_START) {
+		sx->in_sysex = true;
+		sx->len = 0;
+	}
+	if (!sx->in_sysex) return false;
+	if ((b >= 0xF8)) return false;							// realtime may be interleaved
+	if ((b & 0x80) && (b != SYSEX_START) && (b != SYSEX_END)) {
+		sx->in_sysex = false;								// message aborted
+		return false;
+	}
+	if (sx->len < MAX_SYSEX) sx->buf [sx->len++] = b;
+	if (b == SYSEX_END) {
+		sx->in_sysex = false;
+		return true;
+	}
+	return false;
+}
+
+// wait for a SysEx message for up to timeout; return its length, 0 on timeout
+static int sysex_read (struct sysex_in *sx, uint64_t timeout_us)
+{
+	struct pollfd pfd [4];
+	uint64_t end = now_us () + timeout_us;
+	uint64_t now;
+	uint8_t b;
+	int npfd;
+
+	npfd = snd_rawmidi_poll_descriptors (midi_in, pfd, 4);
+	while ((now = now_us ()) < end) {
+		while (snd_rawmidi_read (midi_in, &b, 1) == 1) {
+			if (sysex_feed (sx, b)) return sx->len;
+		}
+		poll (pfd, npfd, (int) ((end - now + 999) / 1000));
+	}
+	return 0;
+}
+
+static void sysex_write (uint8_t const *msg, int len)
+{
+	snd_rawmidi_write (midi_out, msg, len);
+	snd_rawmidi_drain (midi_out);
+}
+
+
+//--------------------------------------------------------------------+
+// Probe
+//--------------------------------------------------------------------+
+
+static int cmp_int64 (const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int64_t percentile (int64_t const *sorted, int n, double p)
+{
+	int i = (int) (p * (n - 1) + 0.5);
+
+	return sorted [i];
+}
+
+static void print_distribution (const char *name, int64_t *values, int n)
+{
+	qsort (values, n, sizeof (values [0]), cmp_int64);
+	printf ("%-24s min %6lld  p50 %6lld  p90 %6lld  p99 %6lld  max %6lld us\n", name,
+			(long long) values [0], (long long) percentile (values, n, 0.5), (long long) percentile (values, n, 0.9),
+			(long long) percentile (values, n, 0.99), (long long) values [n - 1]);
+}
+
+// send one ping and wait for its pong; return false if lost
+static bool ping (uint16_t seq, struct sample *s)
+{
+	struct sysex_in sx = { .len = 0, .in_sysex = false };
+	uint8_t msg [6] = { SYSEX_START, SYSEX_ID, SYSEX_PING, (seq >> 7) & 0x7F, seq & 0x7F, SYSEX_END };
+	uint64_t deadline;
+	int len;
+
+	s->t1 = now_us ();
+	sysex_write (msg, sizeof (msg));
+	deadline = s->t1 + PONG_TIMEOUT_US;
+
+	while (now_us () < deadline) {
+		len = sysex_read (&sx, deadline - now_us ());
+		s->t4 = now_us ();
+		if ((len != PONG_LEN) || (sx.buf [1] != SYSEX_ID) || (sx.buf [2] != SYSEX_PING)) continue;
+		if (get_7bit (&sx.buf [3], 2) != (seq & 0x3FFF)) continue;		// late pong of a previous ping
+		s->t2 = get_7bit (&sx.buf [5], 10);
+		s->t3 = get_7bit (&sx.buf [15], 10);
+		s->delay = (int64_t) (s->t4 - s->t1) - (int64_t) (s->t3 - s->t2);
+		s->offset = (((double) s->t2 - (double) s->t1) + ((double) s->t3 - (double) s->t4)) / 2;
+		return true;
+	}
+	return false;
+}
+
+static int probe (int bursts, int pings, int ping_ms, int burst_ms)
+{
+	struct sample *samples = calloc ((size_t) bursts * pings, sizeof (struct sample));
+	struct sample *best = calloc (bursts, sizeof (struct sample));
+	int64_t *values = calloc ((size_t) bursts * pings, sizeof (int64_t));
+	int nbest = 0;
+	int n = 0;
+	int lost = 0;
+	uint16_t seq = 0;
+	double sx = 0, sy = 0, sxx = 0, sxy = 0, x, x0, slope = 0, intercept, d;
+	int b, k, i;
+
+	for (b = 0; b < bursts; b++) {
+		int first = n;
+
+		for (k = 0; k < pings; k++) {
+			if (ping (seq++, &samples [n])) samples [n++].burst = b;
+			else lost++;
+			sleep_us ((uint64_t) ping_ms * 1000);
+		}
+
+		// clock filter: keep lowest-delay sample of burst
+		if (n > first) {
+			i = first;
+			for (k = first; k < n; k++) if (samples [k].delay < samples [i].delay) i = k;
+			best [nbest++] = samples [i];
+		}
+		fprintf (stderr, "burst %d/%d: %d pongs\n", b + 1, bursts, n - first);
+		if (b < bursts - 1) sleep_us ((uint64_t) burst_ms * 1000);
+	}
+
+	printf ("%d pings, %d pongs, %d lost\n", bursts * pings, n, lost);
+	if (n == 0) return 1;
+
+	for (i = 0; i < n; i++) values [i] = (int64_t) (samples [i].t4 - samples [i].t1);
+	print_distribution ("round trip (t4-t1)", values, n);
+	for (i = 0; i < n; i++) values [i] = samples [i].delay;
+	print_distribution ("delay (excl. device)", values, n);
+	for (i = 0; i < n; i++) values [i] = (int64_t) (samples [i].t3 - samples [i].t2);
+	print_distribution ("device (t3-t2)", values, n);
+
+	// least-squares fit of filtered offsets over host time (midpoint of each ping): slope is drift in us/s = ppm
+	x0 = (double) best [0].t1;
+	for (i = 0; i < nbest; i++) {
+		x = ((double) best [i].t1 + (double) (best [i].t4 - best [i].t1) / 2 - x0) / 1e6;
+		sx += x;
+		sy += best [i].offset;
+		sxx += x * x;
+		sxy += x * best [i].offset;
+	}
+	d = nbest * sxx - sx * sx;
+	if ((nbest >= 2) && (fabs (d) > 1e-12)) slope = (nbest * sxy - sx * sy) / d;
+	intercept = (sy - slope * sx) / nbest;
+	x = ((double) best [nbest - 1].t1 - x0) / 1e6;
+
+	printf ("clock offset (device - host) %.1f us at host time %.6f s, +/- %.1f us\n",
+			intercept + slope * x, (double) best [nbest - 1].t1 / 1e6, (double) best [nbest - 1].delay / 2);
+	if (nbest >= 2) printf ("clock drift %.2f ppm (%d bursts)\n", slope, nbest);
+	else printf ("clock drift: needs at least 2 bursts\n");
+
+	free (samples);
+	free (best);
+	free (values);
+	return 0;
+}
+
+
+//--------------------------------------------------------------------+
+// Respond (device stand-in)
+//--------------------------------------------------------------------+
+
+static int respond (double offset_us, double drift_ppm)
+{
+	struct sysex_in sx = { .len = 0, .in_sysex = false };
+	uint8_t pong [PONG_LEN];
+	uint64_t start = now_us ();
+	uint64_t t;
+	int len, i;
+
+	fprintf (stderr, "answering pings, offset %.1f us, drift %.2f ppm\n", offset_us, drift_ppm);
+	while (1) {
+		len = sysex_read (&sx, 1000000);
+		if ((len < 6) || (sx.buf [1] != SYSEX_ID) || (sx.buf [2] != SYSEX_PING)) continue;
+
+		// one pong per sequence number in message, as the pedal does
+		for (i = 3; i + 2 <= len - 1; i += 2) {
+			t = now_us ();
+			t = (uint64_t) ((double) t + offset_us + drift_ppm * (double) (t - start) / 1e6);
+			pong [0] = SYSEX_START;
+			pong [1] = SYSEX_ID;
+			pong [2] = SYSEX_PING;
+			pong [3] = sx.buf [i];
+			pong [4] = sx.buf [i + 1];
+			put_7bit (&pong [5], t, 10);
+			put_7bit (&pong [15], t, 10);
+			pong [25] = SYSEX_END;
+			sysex_write (pong, sizeof (pong));
+		}
+	}
+	return 0;
+}
+
+
+int main (int argc, char *argv [])
+{
+	int bursts = 10, pings = 20, ping_ms = 5, burst_ms = 1000;
+	double offset_us = 1000000, drift_ppm = 50;
+	bool responder = false;
+	int opt, err;
+
+	while ((opt = getopt (argc, argv, "b:n:i:I:ro:d:")) != -1) {
+		switch (opt) {
+			case 'b': bursts = atoi (optarg); break;
+			case 'n': pings = atoi (optarg); break;
+			case 'i': ping_ms = atoi (optarg); break;
+			case 'I': burst_ms = atoi (optarg); break;
+			case 'r': responder = true; break;
+			case 'o': offset_us = atof (optarg); break;
+			case 'd': drift_ppm = atof (optarg); break;
+			default:
+				fprintf (stderr, "usage: %s [-b bursts] [-n pings] [-i ping_ms] [-I burst_ms] <port>\n"
+						 "       %s -r [-o offset_us] [-d drift_ppm] <port>\n", argv [0], argv [0]);
+				return 2;
+		}
+	}
+	if ((optind >= argc) || (bursts < 1) || (pings < 1)) {
+		fprintf (stderr, "%s: missing ALSA rawmidi port (eg. hw:1,0,2), see 'amidi -l'\n", argv [0]);
+		return 2;
+	}
+
+	err = snd_rawmidi_open (&midi_in, &midi_out, argv [optind], SND_RAWMIDI_NONBLOCK);
+	if (err < 0) {
+		fprintf (stderr, "cannot open %s: %s\n", argv [optind], snd_strerror (err));
+		return 1;
+	}
+	snd_rawmidi_nonblock (midi_out, 0);
+
+	err = responder ? respond (offset_us, drift_ppm) : probe (bursts, pings, ping_ms, burst_ms);
+
+	snd_rawmidi_close (midi_in);
+	snd_rawmidi_close (midi_out);
+	return err;
+}